@@ -0,0 +1,95 @@
+/*
+This source code file is licensed under the GNU GPL Version 2.0 Licence by the following copyright holder:
+Crown Copyright Commonwealth of Australia (Geoscience Australia) 2015.
+The GNU GPL 2.0 licence is available at: http://www.gnu.org/licenses/gpl-2.0.html. If you require a paper copy of the GNU GPL 2.0 Licence, please write to Free Software Foundation, Inc. 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+Author: Ross C. Brodie, Geoscience Australia.
+*/
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "gaaem_version.h"
+#include "general_utils.h"
+#include "file_utils.h"
+#include "blocklanguage.h"
+#include "logger.h"
+#include "stacktrace.h"
+#include "inputmanager.h"
+#include "columnarfile.h"
+
+class cLogger glog; //The global instance of the log file manager
+class cStackTrace gtrace; //The global instance of the stacktrace
+
+//Converts the ASCII Input DataFile of a control file to a columnar binary .gcol file.
+//Setting the control file's Input DataFile to the .gcol file then skips text parsing in later runs.
+int main(int argc, char** argv)
+{
+	glog.logmsg("%s\n", commandlinestring(argc, argv).c_str());
+	glog.logmsg("%s\n", versionstring(GAAEM_VERSION, __TIME__, __DATE__).c_str());
+	if (argc != 3) {
+		glog.logmsg("Usage: %s control_file_name output_columnar_file.gcol\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	double t1 = gettime();
+	cBlock ib = cBlock(argv[1]).findblock("Input");
+	std::string outfile = argv[2];
+	if (cInputManager::isnetcdf(ib) || cInputManager::iscolumnar(ib)) {
+		glog.logmsg("Error: the Input DataFile must be an ASCII file\n");
+		return EXIT_FAILURE;
+	}
+
+	cASCIIInputManager IM(ib);
+	const std::vector<cAsciiColumnField>& acols = IM.columnfields();
+	if (acols.size() == 0) {
+		glog.logmsg("Error: a HeaderFile is required to define the fields\n");
+		return EXIT_FAILURE;
+	}
+
+	std::vector<cColumnarField> fields;
+	std::vector<size_t> firstcolumn;
+	for (size_t fi = 0; fi < acols.size(); fi++) {
+		const cAsciiColumnField& a = acols[fi];
+		cColumnarField f;
+		f.name = a.name.size() > 0 ? a.name : strprint("column_%zu", fi + 1);
+		f.units = a.get_att(cAsciiColumnField::UNITS);
+		f.description = a.get_att(cAsciiColumnField::DESC);
+		f.type = cColumnarField::type_from_format(a.fmtchar);
+		f.nbands = a.nbands;
+		f.width = a.width;
+		f.decimals = a.decimals;
+		f.fmtchar = a.fmtchar;
+		fields.push_back(f);
+		firstcolumn.push_back((size_t)a.startcol());
+	}
+
+	cColumnarFileWriter W;
+	if (W.open(outfile, fields) == false) {
+		glog.logmsg("Error: could not open %s for writing\n", outfile.c_str());
+		return EXIT_FAILURE;
+	}
+
+	//Every record is kept, including non-valid ones, so that record numbers match the ASCII file
+	size_t record = 0;
+	while (IM.load_record(record)) {
+		const bool valid = IM.is_record_valid() && IM.parse_record();
+		for (size_t fi = 0; fi < fields.size(); fi++) {
+			for (size_t k = 0; k < fields[fi].nbands; k++) {
+				W.append(fi, valid ? IM.column_string(firstcolumn[fi] + k) : std::string_view());
+			}
+		}
+		W.end_record(valid);
+		record++;
+		if (record % 100000 == 0) glog.logmsg("Converted %zu records\n", record);
+	}
+
+	if (W.close() == false) {
+		glog.logmsg("Error: could not write %s\n", outfile.c_str());
+		return EXIT_FAILURE;
+	}
+	glog.logmsg("Wrote %zu records of %zu fields to %s\n", W.nrecords(), fields.size(), outfile.c_str());
+	glog.logmsg("Elapsed time = %.2lf seconds\n", gettime() - t1);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,153 @@
+/*
+This source code file is licensed under the GNU GPL Version 2.0 Licence by the following copyright holder:
+Crown Copyright Commonwealth of Australia (Geoscience Australia) 2015.
+The GNU GPL 2.0 licence is available at: http://www.gnu.org/licenses/gpl-2.0.html. If you require a paper copy of the GNU GPL 2.0 Licence, please write to Free Software Foundation, Inc. 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+Author: Ross C. Brodie, Geoscience Australia.
+*/
+
+#ifndef _asyncblockwriter_H
+#define _asyncblockwriter_H
+
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <ostream>
+
+//Appends text to an output stream from a background thread.
+//The caller fills a block which, once large enough, is handed to the writer through a ring of blocks,
+//so the caller only waits if every block in the ring is still waiting to be written.
+//The writer sleeps until a block is handed over, and also takes the block being filled itself
+//once it is old enough, so sparse output (e.g. slow inversions) reaches the file in a timely way.
+class cAsyncBlockWriter {
+
+	static constexpr size_t NSlots = 8;
+	std::array<std::string, NSlots> Slots;
+	size_t Head = 0;//Next slot to be filled
+	size_t Tail = 0;//Next slot to be written by the writer thread
+	bool Stop = false;
+	std::atomic<bool> Failed{ false };
+	std::mutex Mutex;//Guards Slots, Head, Tail, Stop, Block and BlockStart
+	std::condition_variable Ready;//Signals the writer
+	std::condition_variable Space;//Signals the caller that a slot has been written
+
+	std::ostream* Stream = nullptr;
+	std::thread Writer;
+	std::string Block;
+	size_t BlockSize = 1 << 20;
+	double MaxBlockAge = 10.0;//seconds
+	std::chrono::steady_clock::time_point BlockStart;
+	int64_t Offset = 0;
+
+	std::chrono::duration<double> block_age() const {
+		return std::chrono::steady_clock::now() - BlockStart;
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(Mutex);
+		while (true) {
+			if (Tail == Head) {
+				if (Block.empty() == false && block_age().count() >= MaxBlockAge) {
+					submit(lock);
+					continue;
+				}
+				if (Stop) break;
+				if (Block.empty()) {
+					Ready.wait(lock);
+				}
+				else {
+					const std::chrono::duration<double> wait(MaxBlockAge - block_age().count());
+					Ready.wait_for(lock, wait);
+				}
+				continue;
+			}
+
+			//The caller does not touch a slot until it has been written, so it is written unlocked
+			std::string& s = Slots[Tail % NSlots];
+			lock.unlock();
+			Stream->write(s.data(), (std::streamsize)s.size());
+			if (!(*Stream)) Failed.store(true, std::memory_order_release);
+			s.clear();
+			lock.lock();
+			Tail++;
+			Space.notify_one();
+		}
+		lock.unlock();
+		Stream->flush();
+	}
+
+	void submit(std::unique_lock<std::mutex>& lock) {
+		if (Block.empty()) return;
+		Space.wait(lock, [this] { return Head - Tail < NSlots; });
+		//The slot was cleared by the writer so the swap hands its capacity back for reuse
+		Slots[Head % NSlots].swap(Block);
+		Head++;
+		Ready.notify_one();
+	}
+
+public:
+
+	cAsyncBlockWriter() {};
+
+	~cAsyncBlockWriter() {
+		stop();
+	};
+
+	//offset is the current size of the stream so that offset() reports the logical file size
+	void start(std::ostream& stream, const int64_t& offset) {
+		Stream = &stream;
+		Offset = offset;
+		Head = 0;
+		Tail = 0;
+		Stop = false;
+		Failed.store(false);
+		Block.reserve(BlockSize + (BlockSize >> 2));
+		BlockStart = std::chrono::steady_clock::now();
+		Writer = std::thread(&cAsyncBlockWriter::run, this);
+	}
+
+	bool running() const {
+		return Writer.joinable();
+	}
+
+	void append(const std::string& s) {
+		std::unique_lock<std::mutex> lock(Mutex);
+		if (Block.empty()) {
+			BlockStart = std::chrono::steady_clock::now();
+			//Start the writer's age timer
+			Ready.notify_one();
+		}
+		Block += s;
+		Offset += (int64_t)s.size();
+		if (Block.size() >= BlockSize) {
+			submit(lock);
+		}
+	}
+
+	void stop() {
+		if (running() == false) return;
+		{
+			std::unique_lock<std::mutex> lock(Mutex);
+			submit(lock);
+			Stop = true;
+			Ready.notify_one();
+		}
+		Writer.join();
+	}
+
+	//Bytes appended so far including any not yet written
+	int64_t offset() const {
+		return Offset;
+	}
+
+	bool failed() const {
+		return Failed.load(std::memory_order_acquire);
+	}
+};
+
+#endif
@@ -25,6 +25,7 @@ Author: Ross C. Brodie, Geoscience Australia.
 #include "gaaem_version.h"
 #include "samplebunch.h"
 #include "inversion_line_searcher.h"
+#include "phaseprofiler.h"
 
 #if defined _OPENMP
 #include <omp.h>
@@ -33,7 +34,8 @@ extern omp_lock_t fftw_thread_lock;
 #endif
 
 enum class eBracketResult { BRACKETED, MINBRACKETED, ALLABOVE, ALLBELOW };
-enum class eNormType { L1, L2 };
+enum class eNormType { L1, L2, HUBER, EKBLOM };
+enum class eLinearSolver { CHOLESKY, CG, LSQR };
 
 class cInvertibleFieldDefinition {
 
@@ -306,6 +308,7 @@ private:
 
 	cTrial stepfactor_trial(const double& lambda, const Vector& dm, const double& stepfactor)
 	{
+		cScopedPhaseTimer timer(Profiler, ePhase::STEPFACTORTRIAL);
 		cTrial t;
 		Vector p = CIS.param + stepfactor * dm;
 		Vector g(nData);
@@ -391,20 +394,44 @@ private:
 		return t;
 	}
 
-	double lambda_trial_function(cTrialCache& T, const double& lambda, bool dostepfactorsearch)
+	cTrial lambda_trial(const double& lambda, const Vector& dm, const double& target, const bool& dostepfactorsearch)
 	{
-		Vector dm = parameter_change(lambda, CIS.param, CIS.pred);
-		cTrial t;
 		if (dostepfactorsearch) {
-			t = stepfactor_search(lambda, dm, T.target);
-		}
-		else {
-			t = stepfactor_trial(lambda, dm, 1.0);
+			return stepfactor_search(lambda, dm, target);
 		}
+		return stepfactor_trial(lambda, dm, 1.0);
+	}
+
+	double lambda_trial_function(cTrialCache& T, const double& lambda, bool dostepfactorsearch)
+	{
+		cScopedPhaseTimer timer(Profiler, ePhase::LAMBDATRIAL);
+		Vector dm = parameter_change(lambda, CIS.param, CIS.pred);
+		cTrial t = lambda_trial(lambda, dm, T.target, dostepfactorsearch);
 		T.insert(t);
 		return t.phid;
 	}
 
+	std::vector<cTrial> lambda_trial_batch(const std::vector<double>& lambdas, const double& target, const bool& dostepfactorsearch)
+	{
+		//The linear solves update shared constraint state so are done serially,
+		//the step factor searches (i.e. the forward models) are run concurrently
+		const size_t n = lambdas.size();
+		std::vector<Vector> dm(n);
+		for (size_t k = 0; k < n; k++) {
+			dm[k] = parameter_change(lambdas[k], CIS.param, CIS.pred);
+		}
+
+		std::vector<cTrial> trials(n);
+		InTrialRegion = true;
+		#pragma omp parallel for num_threads((int)TrialThreads) schedule(dynamic, 1)
+		for (int k = 0; k < (int)n; k++) {
+			cScopedPhaseTimer timer(Profiler, ePhase::LAMBDATRIAL);
+			trials[k] = lambda_trial(lambdas[k], dm[k], target, dostepfactorsearch);
+		}
+		InTrialRegion = false;
+		return trials;
+	}
+
 	double goldensearch(double a, double b, double c, double xtol, const double lambda, const Vector& m, const Vector& dm, Vector& g, cTrialCache& cache)
 	{
 		//adapted from http://en.wikipedia.org/wiki/Golden_section_search	
@@ -472,30 +499,43 @@ private:
 		bool dostepfactorsearch = true;
 		cInversionLineSearcher s(target);
 		s.set_ytol(target * 0.01);
-		s.set_maxtrials(10);
-		std::vector<double> xlist;
-		if (CIS.iteration == 0) {
-			xlist = increment<double>(32, 8.0, -0.25);
+		const bool warmstart = StartLambda > 0.0;
+		std::vector<double> xlist = initial_lambda_trials(CIS.iteration, currentlambda, warmstart);
+		if (CIS.iteration == 0 && warmstart == false) {
 			s.set_maxtrials(xlist.size() * 2);
 		}
 		else {
 			s.set_maxtrials(10);
-			xlist = {
-				std::log10(currentlambda * 2.0),
-				std::log10(currentlambda),
-				std::log10(currentlambda * 0.5),
-				std::log10(currentlambda * 0.25)
-			};
 		}
 
 		double x;
-		for (size_t i = 0; i < xlist.size(); i++) {
-			double x = xlist[i];
-			double phid = lambda_trial_function(T, pow10(x), dostepfactorsearch);
-			if (Verbose) T.print(CIS.lambda, CIS.phid);
-			s.add_pair(x, phid);
-			if (T.is_target_braketed()) {
-				return eBracketResult::BRACKETED;//target bracketed		
+		const size_t batchsize = std::max(TrialThreads, (size_t)1);
+		for (size_t i = 0; i < xlist.size(); i += batchsize) {
+			//Trials in a batch are evaluated concurrently but accepted in order
+			//so the outcome is the same as evaluating them one at a time
+			const size_t n = std::min(batchsize, xlist.size() - i);
+			std::vector<cTrial> batch;
+			if (n > 1) {
+				std::vector<double> lambdas(n);
+				for (size_t k = 0; k < n; k++) lambdas[k] = pow10(xlist[i + k]);
+				batch = lambda_trial_batch(lambdas, T.target, dostepfactorsearch);
+			}
+
+			for (size_t k = 0; k < n; k++) {
+				double x = xlist[i + k];
+				double phid;
+				if (n > 1) {
+					T.insert(batch[k]);
+					phid = batch[k].phid;
+				}
+				else {
+					phid = lambda_trial_function(T, pow10(x), dostepfactorsearch);
+				}
+				if (Verbose) T.print(CIS.lambda, CIS.phid);
+				s.add_pair(x, phid);
+				if (T.is_target_braketed()) {
+					return eBracketResult::BRACKETED;//target bracketed		
+				}
 			}
 		}
 
@@ -640,6 +680,18 @@ private:
 protected:
 	size_t nForwards = 0;
 	size_t nJacobians = 0;
+	cPhaseProfiler Profiler;
+	size_t TrialThreads = 1;//Number of lambda trials evaluated concurrently
+	double StartLambda = 0.0;//Initial lambda for iterate(), 0 for the default
+	bool InTrialRegion = false;
+
+	//Index of the forward model engine the calling trial thread must use, 0 is the primary engine
+	size_t trial_engine() const {
+#if defined _OPENMP
+		if (InTrialRegion) return (size_t)omp_get_thread_num();
+#endif
+		return 0;
+	}
 
 	std::string CommandLine;
 	int Size;
@@ -667,6 +719,9 @@ protected:
 	Matrix Wm;
 
 	eNormType  NormType;
+	double HuberThreshold = 1.345;//Normalised residual beyond which the Huber norm is linear
+	double EkblomPower = 1.0;//p in the Ekblom norm (r^2 + e^2)^(p/2)
+	double EkblomEpsilon = 1e-4;//e in the Ekblom norm
 
 	double MinimumPhiD;//overall	
 	double MinimumImprovement;//			
@@ -687,6 +742,21 @@ public:
 		CommandLine = commandline;
 	};
 
+	//The log10 lambdas tried first when bracketing the target misfit.
+	//The first iteration sweeps 8 decades unless it is warm started from a known lambda.
+	static std::vector<double> initial_lambda_trials(const size_t& iteration, const double& currentlambda, const bool& warmstart)
+	{
+		if (iteration == 0 && warmstart == false) {
+			return increment<double>(32, 8.0, -0.25);
+		}
+		return {
+			std::log10(currentlambda * 2.0),
+			std::log10(currentlambda),
+			std::log10(currentlambda * 0.5),
+			std::log10(currentlambda * 0.25)
+		};
+	}
+
 	virtual ~cInverter()
 	{
 		glog.close();
@@ -740,31 +810,66 @@ public:
 #endif	
 	}
 
-	double l1_norm(const Vector& g)
+	double l2_norm(const Vector& g)
 	{
-		double l1 = 0.0;
-		for (size_t i = 0; i < nData; i++) {
-			l1 += std::abs(Obs[i] - g[i]) / Err[i];
+		//Wd is diagonal
+		const Vector v = Obs - g;
+		return v.cwiseAbs2().dot(Wd.diagonal());
+	}
+
+	//Penalty applied to a noise normalised residual r.
+	//L2 and Huber are r^2 near zero, L1 is |r| and Ekblom is (r^2 + eps^2)^(p/2), which is about eps^p near zero.
+	double robust_penalty(const double& r) const
+	{
+		const double a = std::abs(r);
+		switch (NormType) {
+		case eNormType::L1:
+			return a;
+		case eNormType::HUBER:
+			if (a <= HuberThreshold) return r * r;
+			return 2.0 * HuberThreshold * a - HuberThreshold * HuberThreshold;
+		case eNormType::EKBLOM:
+			return std::pow(r * r + EkblomEpsilon * EkblomEpsilon, 0.5 * EkblomPower);
+		default:
+			return r * r;
+		}
+	}
+
+	//Iteratively reweighted least squares multiplier of the L2 data weight for residual r.
+	//It is proportional to penalty'(r) / 2r. The constant factors 1/2 (L1) and p/2 (Ekblom) are left out:
+	//scaling every data weight by the same amount only rescales lambda, which the lambda search chooses anyway.
+	double irls_weight(const double& r) const
+	{
+		const double a = std::max(std::abs(r), 1e-8);
+		switch (NormType) {
+		case eNormType::L1:
+			return 1.0 / a;
+		case eNormType::HUBER:
+			return a <= HuberThreshold ? 1.0 : HuberThreshold / a;
+		case eNormType::EKBLOM:
+			return std::pow(r * r + EkblomEpsilon * EkblomEpsilon, 0.5 * EkblomPower - 1.0);
+		default:
+			return 1.0;
 		}
-		return l1 / nData;
 	}
 
-	double l2_norm(const Vector& g)
+	double robust_norm(const Vector& g)
 	{
-		Vector v = Obs - g;
-		Vector a = Wd * v;
-		double l2 = mtDm(v, Wd);
-		return l2;
+		double phi = 0.0;
+		for (size_t i = 0; i < nData; i++) {
+			phi += robust_penalty((Obs[i] - g[i]) / Err[i]);
+		}
+		return phi / nData;
 	}
 
 	double phiData(const Vector& g)
 	{
 		double phid;
-		if (NormType == eNormType::L1) {
-			phid = l1_norm(g);
+		if (NormType == eNormType::L2) {
+			phid = l2_norm(g);
 		}
 		else {
-			phid = l2_norm(g);
+			phid = robust_norm(g);
 		}
 		//This reports invalid models 
 		if (phid < 0.0) {
@@ -838,27 +943,34 @@ public:
 
 	Vector compute_parameter_sensitivity()
 	{
-		Vector s = Vector::Zero(nParam);
-		for (size_t pi = 0; pi < nParam; pi++) {
-			for (size_t di = 0; di < nData; di++) {
-				s[pi] += (std::fabs(J(di, pi)) * std::sqrt((double)nData * Wd(di, di)));
-			}
-		}
+		const Vector w = ((double)nData * Wd.diagonal()).cwiseSqrt();
+		Vector s = J.cwiseAbs().transpose() * w;
 		return s;
 	}
 
 	Vector compute_parameter_uncertainty()
 	{
-		Matrix JtWdJ = J.transpose() * Wd * J;
-		Matrix iCm = Matrix::Zero(nParam, nParam);
+		//Wd is diagonal so form J'WdJ without the dense nData x nData product
+		const Vector w = (double)nData * Wd.diagonal();
+		Matrix X = J.transpose() * w.asDiagonal() * J;
 		for (size_t i = 0; i < nParam; i++) {
-			iCm(i, i) = 1.0 / (RefParamStd[i] * RefParamStd[i]);
+			X(i, i) += 1.0 / (RefParamStd[i] * RefParamStd[i]);
 		}
-		Matrix X = (double)nData * JtWdJ + iCm;
-		Matrix pinvX = pseudoInverse(X);
+
 		Vector s(nParam);
-		for (size_t i = 0; i < nParam; i++) {
-			s[i] = std::sqrt(pinvX(i, i));
+		const Eigen::LLT<Matrix> llt(X);
+		if (llt.info() == Eigen::Success) {
+			//diag(inv(X)) = squared column norms of inv(L) since inv(X) = inv(L)' inv(L)
+			const Matrix Linv = llt.matrixL().solve(Matrix::Identity(nParam, nParam));
+			for (size_t i = 0; i < nParam; i++) {
+				s[i] = Linv.col(i).norm();
+			}
+		}
+		else {
+			Matrix pinvX = pseudoInverse(X);
+			for (size_t i = 0; i < nParam; i++) {
+				s[i] = std::sqrt(pinvX(i, i));
+			}
 		}
 		return s;
 	}
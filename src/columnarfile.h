@@ -0,0 +1,365 @@
+/*
+This source code file is licensed under the GNU GPL Version 2.0 Licence by the following copyright holder:
+Crown Copyright Commonwealth of Australia (Geoscience Australia) 2015.
+The GNU GPL 2.0 licence is available at: http://www.gnu.org/licenses/gpl-2.0.html. If you require a paper copy of the GNU GPL 2.0 Licence, please write to Free Software Foundation, Inc. 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+Author: Ross C. Brodie, Geoscience Australia.
+*/
+
+#ifndef _columnarfile_H
+#define _columnarfile_H
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+
+#include "general_utils.h"
+#include "file_utils.h"
+#include "logger.h"
+#include "mappedrecordfile.h"
+
+//Columnar binary copy of an ASCII survey data file (.gcol).
+//Each field is stored as one contiguous native endian array of nrecords x nbands values,
+//so a memory mapped file can be read with no text parsing.
+//
+//Layout: cHeader, nfields x cEntry, then each field's array starting on an 8 byte boundary,
+//then one byte per record flagging whether the ASCII record was valid.
+//A readable copy of the schema is written alongside as file.gcol.json.
+
+enum class eColumnType : uint32_t { INT, DOUBLE, TEXT };
+
+class cColumnarField {
+public:
+	std::string name;
+	std::string units;
+	std::string description;
+	eColumnType type = eColumnType::DOUBLE;
+	size_t nbands = 1;
+	size_t width = 0;//ascii width, also the bytes per band of TEXT fields
+	size_t decimals = 0;
+	char fmtchar = 'F';
+	uint64_t offset = 0;
+
+	size_t element_size() const {
+		if (type == eColumnType::INT) return sizeof(int32_t);
+		if (type == eColumnType::DOUBLE) return sizeof(double);
+		return width;
+	}
+
+	static eColumnType type_from_format(const char& fmtchar) {
+		if (fmtchar == 'I' || fmtchar == 'i') return eColumnType::INT;
+		if (fmtchar == 'A' || fmtchar == 'a') return eColumnType::TEXT;
+		return eColumnType::DOUBLE;
+	}
+};
+
+class cColumnarFormat {
+
+protected:
+
+	static constexpr char Magic[8] = { 'G','A','A','E','M','C','O','L' };
+	static constexpr uint64_t Version = 1;
+
+	struct cHeader {
+		char magic[8];
+		uint64_t version;
+		uint64_t nrecords;
+		uint64_t nfields;
+		uint64_t validoffset;
+	};
+
+	struct cEntry {
+		char name[64];
+		char units[32];
+		char description[128];
+		uint32_t type;
+		uint32_t nbands;
+		uint32_t width;
+		uint32_t decimals;
+		uint64_t offset;
+		char fmtchar;
+		char pad[7];
+	};
+
+	static void copy_string(char* dst, const size_t& n, const std::string& src) {
+		std::memset(dst, 0, n);
+		std::memcpy(dst, src.data(), std::min(src.size(), n - 1));
+	}
+
+	static std::string entry_string(const char* src, const size_t& n) {
+		return std::string(src, strnlen(src, n));
+	}
+
+	static uint64_t aligned(const uint64_t& n) {
+		return (n + 7) & ~(uint64_t)7;
+	}
+};
+
+//Writes a .gcol file a record at a time.
+//Values are buffered per field and spilled to one temporary file per field, which are joined on close.
+class cColumnarFileWriter : public cColumnarFormat {
+
+	std::string Path;
+	std::vector<cColumnarField> Fields;
+	std::vector<std::string> TmpNames;
+	std::vector<std::ofstream> Tmp;
+	std::vector<std::string> Chunk;
+	std::vector<char> Valid;
+	size_t ChunkBytes = 0;
+	size_t MaxChunkBytes = 64 << 20;
+	size_t NRecords = 0;
+
+	void spill() {
+		for (size_t fi = 0; fi < Fields.size(); fi++) {
+			Tmp[fi].write(Chunk[fi].data(), (std::streamsize)Chunk[fi].size());
+			Chunk[fi].clear();
+		}
+		ChunkBytes = 0;
+	}
+
+	void write_schema() const {
+		std::ofstream ofs(Path + ".json");
+		ofs << "{\n";
+		ofs << "\t\"format\": \"gaaem-columnar\",\n";
+		ofs << "\t\"version\": " << Version << ",\n";
+		ofs << "\t\"nrecords\": " << NRecords << ",\n";
+		ofs << "\t\"fields\": [\n";
+		for (size_t fi = 0; fi < Fields.size(); fi++) {
+			const cColumnarField& f = Fields[fi];
+			const char* t = f.type == eColumnType::INT ? "int32" : (f.type == eColumnType::DOUBLE ? "float64" : "text");
+			ofs << "\t\t{ \"name\": \"" << f.name << "\", \"type\": \"" << t << "\", \"bands\": " << f.nbands;
+			ofs << ", \"format\": \"" << f.fmtchar << f.width << "." << f.decimals << "\"";
+			ofs << ", \"units\": \"" << f.units << "\", \"offset\": " << f.offset << " }";
+			ofs << (fi + 1 < Fields.size() ? ",\n" : "\n");
+		}
+		ofs << "\t]\n";
+		ofs << "}\n";
+	}
+
+public:
+
+	cColumnarFileWriter() {};
+
+	~cColumnarFileWriter() {
+		for (size_t fi = 0; fi < Tmp.size(); fi++) {
+			if (Tmp[fi].is_open()) {
+				Tmp[fi].close();
+				deletefile(TmpNames[fi]);
+			}
+		}
+	};
+
+	bool open(const std::string& path, const std::vector<cColumnarField>& fields) {
+		Path = path;
+		Fields = fields;
+		Chunk.resize(Fields.size());
+		Tmp.resize(Fields.size());
+		TmpNames.resize(Fields.size());
+		for (size_t fi = 0; fi < Fields.size(); fi++) {
+			TmpNames[fi] = Path + strprint(".%zu.tmp", fi);
+			Tmp[fi].open(TmpNames[fi], std::ios::binary | std::ios::trunc);
+			if (!Tmp[fi]) return false;
+		}
+		return true;
+	}
+
+	//Text of one band of a field, converted to the field's storage type
+	void append(const size_t& fi, const std::string_view& text) {
+		const cColumnarField& f = Fields[fi];
+		std::string& c = Chunk[fi];
+		if (f.type == eColumnType::INT) {
+			int v;
+			parse_column_text(text, v);
+			int32_t i = (int32_t)v;
+			c.append((const char*)&i, sizeof(i));
+		}
+		else if (f.type == eColumnType::DOUBLE) {
+			double v;
+			parse_column_text(text, v);
+			c.append((const char*)&v, sizeof(v));
+		}
+		else {
+			std::string s(text.substr(0, f.width));
+			s.resize(f.width, ' ');
+			c.append(s);
+		}
+		ChunkBytes += f.element_size();
+	}
+
+	void end_record(const bool& valid) {
+		Valid.push_back(valid ? 1 : 0);
+		NRecords++;
+		if (ChunkBytes >= MaxChunkBytes) spill();
+	}
+
+	bool close() {
+		spill();
+		uint64_t offset = aligned(sizeof(cHeader) + Fields.size() * sizeof(cEntry));
+		for (size_t fi = 0; fi < Fields.size(); fi++) {
+			Tmp[fi].close();
+			Fields[fi].offset = offset;
+			offset = aligned(offset + NRecords * Fields[fi].nbands * Fields[fi].element_size());
+		}
+		const uint64_t validoffset = offset;
+
+		std::ofstream ofs(Path, std::ios::binary | std::ios::trunc);
+		cHeader h;
+		std::memcpy(h.magic, Magic, sizeof(Magic));
+		h.version = Version;
+		h.nrecords = NRecords;
+		h.nfields = Fields.size();
+		h.validoffset = validoffset;
+		ofs.write((const char*)&h, sizeof(h));
+		for (const cColumnarField& f : Fields) {
+			cEntry e;
+			std::memset(&e, 0, sizeof(e));
+			copy_string(e.name, sizeof(e.name), f.name);
+			copy_string(e.units, sizeof(e.units), f.units);
+			copy_string(e.description, sizeof(e.description), f.description);
+			e.type = (uint32_t)f.type;
+			e.nbands = (uint32_t)f.nbands;
+			e.width = (uint32_t)f.width;
+			e.decimals = (uint32_t)f.decimals;
+			e.offset = f.offset;
+			e.fmtchar = f.fmtchar;
+			ofs.write((const char*)&e, sizeof(e));
+		}
+
+		std::vector<char> buf(1 << 20);
+		for (size_t fi = 0; fi < Fields.size(); fi++) {
+			const std::string pad((size_t)(Fields[fi].offset - (uint64_t)ofs.tellp()), 0);
+			ofs.write(pad.data(), (std::streamsize)pad.size());
+			std::ifstream in(TmpNames[fi], std::ios::binary);
+			while (in) {
+				in.read(buf.data(), (std::streamsize)buf.size());
+				ofs.write(buf.data(), in.gcount());
+			}
+			in.close();
+			deletefile(TmpNames[fi]);
+		}
+		const std::string pad((size_t)(validoffset - (uint64_t)ofs.tellp()), 0);
+		ofs.write(pad.data(), (std::streamsize)pad.size());
+		ofs.write(Valid.data(), (std::streamsize)Valid.size());
+		Tmp.clear();
+		const bool status = (bool)ofs;
+		ofs.close();
+		write_schema();
+		return status;
+	}
+
+	const size_t& nrecords() const { return NRecords; }
+};
+
+//Memory mapped read access to a .gcol file
+class cColumnarFile : public cColumnarFormat {
+
+	cMemoryMappedFile Map;
+	std::vector<cColumnarField> Fields;
+	std::vector<size_t> FirstColumn;//column number (zero based) of the first band of each field in the original ASCII file
+	size_t NRecords = 0;
+	const char* Valid = nullptr;
+
+public:
+
+	cColumnarFile() {};
+
+	bool open(const std::string& path) {
+		if (Map.open(path) == false) return false;
+		if (Map.size() < sizeof(cHeader)) return false;
+
+		cHeader h;
+		std::memcpy(&h, Map.data(), sizeof(h));
+		if (std::memcmp(h.magic, Magic, sizeof(Magic)) != 0) return false;
+		if (h.version != Version) return false;
+		NRecords = (size_t)h.nrecords;
+		if (h.validoffset > Map.size() || NRecords > Map.size() - h.validoffset) return false;
+		Valid = Map.data() + h.validoffset;
+
+		//The field table must lie within the file (written as a division so a corrupt count cannot overflow)
+		if (h.nfields > (Map.size() - sizeof(cHeader)) / sizeof(cEntry)) return false;
+
+		size_t column = 0;
+		const char* p = Map.data() + sizeof(cHeader);
+		for (size_t fi = 0; fi < h.nfields; fi++) {
+			cEntry e;
+			std::memcpy(&e, p + fi * sizeof(cEntry), sizeof(e));
+			if (e.type > (uint32_t)eColumnType::TEXT) return false;
+			if ((eColumnType)e.type == eColumnType::TEXT && e.width == 0) return false;
+			cColumnarField f;
+			f.name = entry_string(e.name, sizeof(e.name));
+			f.units = entry_string(e.units, sizeof(e.units));
+			f.description = entry_string(e.description, sizeof(e.description));
+			f.type = (eColumnType)e.type;
+			f.nbands = e.nbands;
+			f.width = e.width;
+			f.decimals = e.decimals;
+			f.offset = e.offset;
+			f.fmtchar = e.fmtchar;
+			const size_t recordbytes = f.nbands * f.element_size();
+			if (f.offset > Map.size()) return false;
+			if (recordbytes > 0 && NRecords > (Map.size() - f.offset) / recordbytes) return false;
+			Fields.push_back(f);
+			FirstColumn.push_back(column);
+			column += f.nbands;
+		}
+		return true;
+	}
+
+	const size_t& nrecords() const { return NRecords; }
+
+	const std::vector<cColumnarField>& fields() const { return Fields; }
+
+	bool valid(const size_t& record) const {
+		return record < NRecords && Valid[record] != 0;
+	}
+
+	int fieldindex(const std::string& name) const {
+		for (size_t fi = 0; fi < Fields.size(); fi++) {
+			if (strcasecmp(Fields[fi].name, name) == 0) return (int)fi;
+		}
+		return -1;
+	}
+
+	//Field and band holding the zero based column c of the original ASCII file
+	bool locate_column(const size_t& c, size_t& fi, size_t& band) const {
+		for (fi = 0; fi < Fields.size(); fi++) {
+			if (c >= FirstColumn[fi] && c < FirstColumn[fi] + Fields[fi].nbands) {
+				band = c - FirstColumn[fi];
+				return true;
+			}
+		}
+		return false;
+	}
+
+	template<typename T>
+	bool get(const size_t& fi, const size_t& record, const size_t& band, T& v) const {
+		const cColumnarField& f = Fields[fi];
+		if (record >= NRecords || band >= f.nbands) {
+			v = undefinedvalue<T>();
+			return false;
+		}
+		const size_t es = f.element_size();
+		const char* p = Map.data() + f.offset + (record * f.nbands + band) * es;
+		if (f.type == eColumnType::INT) {
+			int32_t i;
+			std::memcpy(&i, p, sizeof(i));
+			v = (T)i;
+		}
+		else if (f.type == eColumnType::DOUBLE) {
+			double d;
+			std::memcpy(&d, p, sizeof(d));
+			v = (T)d;
+		}
+		else {
+			return parse_column_text(std::string_view(p, es), v);
+		}
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,161 @@
+/*
+This source code file is licensed under the GNU GPL Version 2.0 Licence by the following copyright holder:
+Crown Copyright Commonwealth of Australia (Geoscience Australia) 2015.
+The GNU GPL 2.0 licence is available at: http://www.gnu.org/licenses/gpl-2.0.html. If you require a paper copy of the GNU GPL 2.0 Licence, please write to Free Software Foundation, Inc. 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+Author: Ross C. Brodie, Geoscience Australia.
+*/
+
+#ifndef _completionjournal_H
+#define _completionjournal_H
+
+#include <cstdint>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+
+#include "logger.h"
+
+//Append-only per process journal of completed records, used to resume interrupted runs.
+//Each line is: record status output_offset
+//where output_offset is the byte size of the output data file after the record was written (-1 if not applicable).
+class cCompletionJournal {
+
+public:
+	class cEntry {
+	public:
+		std::string status;
+		int64_t offset = -1;
+	};
+
+	//A record waiting for its output to reach the file before it is journaled
+	class cPending {
+	public:
+		size_t record = 0;
+		std::string status;
+		int64_t offset = -1;
+		size_t point = 0;//points the output manager had ended when the record finished
+	};
+
+private:
+	std::string FileName;
+	std::ofstream ofs;
+	std::map<size_t, cEntry> Completed;
+	int64_t LastOffset = -1;
+
+	std::uintmax_t load() {
+		//Returns the number of bytes of complete lines so a torn final line can be discarded
+		std::ifstream ifs(FileName);
+		std::uintmax_t validbytes = 0;
+		std::string line;
+		while (std::getline(ifs, line)) {
+			if (ifs.eof()) break;//no newline so the last write was interrupted
+			std::istringstream ss(line);
+			size_t record;
+			std::string status;
+			int64_t offset;
+			if (!(ss >> record >> status >> offset)) break;
+			Completed[record] = { status, offset };
+			if (offset >= 0) LastOffset = offset;
+			validbytes += line.size() + 1;
+		}
+		return validbytes;
+	}
+
+public:
+
+	cCompletionJournal() {};
+
+	~cCompletionJournal() {
+		close();
+	};
+
+	bool open(const std::string& filename, const bool& resume) {
+		close();
+		FileName = filename;
+		Completed.clear();
+		LastOffset = -1;
+		if (resume && std::filesystem::exists(FileName)) {
+			const std::uintmax_t validbytes = load();
+			std::filesystem::resize_file(FileName, validbytes);
+			glog.logmsg(0, "Resuming from journal %s with %zu completed records\n", FileName.c_str(), Completed.size());
+			ofs.open(FileName, std::ofstream::out | std::ofstream::app);
+		}
+		else {
+			ofs.open(FileName, std::ofstream::out | std::ofstream::trunc);
+		}
+
+		if (ofs.is_open() == false) {
+			glog.errormsg(_SRC_, "Could not open journal file %s\n", FileName.c_str());
+		}
+		return true;
+	}
+
+	void close() {
+		if (ofs.is_open()) ofs.close();
+	}
+
+	//Load an existing journal without opening it for writing
+	bool read(const std::string& filename) {
+		close();
+		FileName = filename;
+		Completed.clear();
+		LastOffset = -1;
+		if (std::filesystem::exists(FileName) == false) return false;
+		load();
+		return true;
+	}
+
+	const std::map<size_t, cEntry>& entries() const {
+		return Completed;
+	}
+
+	//Forget records whose output lies beyond the first datasize bytes of the output data file,
+	//e.g. output that was still buffered for writing when the previous run stopped
+	void discard_beyond(const int64_t& datasize) {
+		size_t ndiscarded = 0;
+		LastOffset = -1;
+		for (auto it = Completed.begin(); it != Completed.end();) {
+			if (it->second.offset > datasize) {
+				it = Completed.erase(it);
+				ndiscarded++;
+				continue;
+			}
+			LastOffset = std::max(LastOffset, it->second.offset);
+			++it;
+		}
+		if (ndiscarded == 0) return;
+
+		glog.logmsg(0, "Discarding %zu journal records not present in the output data file\n", ndiscarded);
+		ofs.close();
+		ofs.open(FileName, std::ofstream::out | std::ofstream::trunc);
+		for (const auto& e : Completed) {
+			ofs << e.first << ' ' << e.second.status << ' ' << e.second.offset << '\n';
+		}
+		ofs << std::flush;
+	}
+
+	bool completed(const size_t& record) const {
+		return Completed.count(record) > 0;
+	}
+
+	size_t ncompleted() const {
+		return Completed.size();
+	}
+
+	//Size the output data file should be truncated to before appending new results
+	int64_t resume_offset() const {
+		return LastOffset;
+	}
+
+	void record(const size_t& record, const std::string& status, const int64_t& offset) {
+		ofs << record << ' ' << status << ' ' << offset << '\n' << std::flush;
+		Completed[record] = { status, offset };
+		if (offset >= 0) LastOffset = offset;
+	}
+};
+
+#endif
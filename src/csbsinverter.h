@@ -12,11 +12,14 @@ Author: Ross C. Brodie, Geoscience Australia.
 #include <stdio.h>
 #include <sstream>
 #include <vector>
+#include <map>
 #include <cstring>
 #include <algorithm>
 #include <iomanip>
 #include <functional>
 #include <variant>
+#include <memory>
+#include <deque>
 
 #include "general_types.h"
 #include "string_utils.h"
@@ -27,6 +30,7 @@ Author: Ross C. Brodie, Geoscience Australia.
 #include "tdemsystem.h"
 #include "tdemsysteminfo.h"
 #include "samplebunch.h"
+#include "completionjournal.h"
 #include <Eigen/Cholesky>
 #include <Eigen/LU>
 
@@ -123,6 +127,8 @@ public:
 	bool NoiseEstimates = false;
 	bool PredictedData = false;
 	bool Dump = false;
+	bool Resume = false;
+	bool Profile = false;
 
 	std::string DumpPath(const size_t datafilerecord, const size_t iteration) const
 	{
@@ -147,6 +153,8 @@ public:
 		ObservedData = b.getboolvalue("ObservedData");
 		NoiseEstimates = b.getboolvalue("NoiseEstimates");
 		PredictedData = b.getboolvalue("PredictedData");
+		Resume = b.getboolvalue("Resume");
+		Profile = b.getboolvalue("Profile");
 
 		Dump = b.getboolvalue("Dump");
 		if (Dump) {
@@ -340,10 +348,28 @@ class cSBSInverter : public cInverter {
 	const size_t ZCOMP = 2;
 	const size_t XZAMP = 3;
 	std::vector<std::vector<std::vector<std::vector<int>>>> _dindex_;
+	std::vector<int> ActiveIndex;//Row of each of the nAllData data in the culled data vector, -1 if culled
+
+	//Weighted normal matrix J'VJ kept between linear solves, V = diag(IRLS data weights)
+	class cNormalEquations {
+	public:
+		size_t JacobianVersion = 0;
+		Vector V;
+		Matrix JtVJ;
+	};
+	cNormalEquations NE;
+	size_t JacobianVersion = 1;//Incremented whenever J changes
 
 	int    BeginGeometrySolveIteration = 0;
 	bool   FreeGeometry = false;
+	bool   BroydenUpdate = false;//Use rank-one secant updates of the Jacobian between full recomputes
+	size_t FullJacobianInterval = 4;//Iterations between full Jacobian recomputes when BroydenUpdate is used (Broyden updates in between)
 	Matrix Wr;//Composite reference model matrix
+	Matrix Rm;//Upper triangular factor Rm'Rm = Wm used by the LSQR solver
+
+	eLinearSolver LinearSolver = eLinearSolver::CHOLESKY;
+	double LinearSolverTolerance = 1e-6;
+	size_t LinearSolverMaxIterations = 0;//0 means nParam
 
 	size_t StartRecord = 0; // 1-based first record to be inverted
 	size_t EndRecord = std::numeric_limits<size_t>::max();// 1-based last record to be inverted
@@ -364,7 +390,10 @@ class cSBSInverter : public cInverter {
 	std::vector<cGeomStruct> G;
 	std::vector<cEarthStruct> E;
 	cOutputOptions OO;
+	cCompletionJournal Journal;
+	std::deque<cCompletionJournal::cPending> PendingJournal;
 	std::vector<cTDEmSystemInfo> SV;
+	std::vector<std::vector<std::unique_ptr<cTDEmSystem>>> TrialSystems;//[engine-1][system] extra forward model engines for concurrent lambda trials
 
 	//Column definitions		
 	cInvertibleFieldDefinition fdC;
@@ -386,19 +415,35 @@ class cSBSInverter : public cInverter {
 	std::vector<SampleId> Id;
 	std::vector<cKeyVec<std::string, cFdVrnt, caseinsensetiveequal<std::string>>> AncFld;
 
-private:
+	//Parsed soundings kept so records shared by overlapping bunches are only loaded and parsed once
+	struct cCachedSounding {
+		SampleId id;
+		cKeyVec<std::string, cFdVrnt, caseinsensetiveequal<std::string>> anc;
+		cGeomStruct g;
+		cEarthStruct e;
+		std::vector<std::vector<cTDEmComponentInfo::SoundingData>> data;//[system][component]
+		std::vector<std::vector<cScaleFactorsStruct>> sf;//[system][component]
+	};
+	std::map<size_t, cCachedSounding> SoundingCache;
+	size_t JobBlockSize = 1;//Number of consecutive records assigned to a process at a time
 
+	//Coarse-to-fine mode, a decimated pass whose models warm start the full resolution pass
+	class cCoarseModel {
+	public:
+		int line = -1;
+		Vector sounding;//Parameters of the master sounding
+		Vector scaling;//Scaling factor parameters
+		double lambda = 0.0;
+	};
+	bool   CoarseToFine = false;
+	size_t CoarseSubsample = 10;//Jobs between coarse anchor records
+	bool   CoarseReference = false;//Also use the interpolated coarse model as the reference model
+	std::map<size_t, cCoarseModel> CoarseModels;//keyed by master record
+	Vector StartParam;//Start model for iterate(), empty to start from the reference model
+
+private:
 
 
-	Vector cull(const Vector& vall) const {
-		assert(ActiveData.size() == nData);
-		assert(vall.size() == nAllData);
-		Vector vcull(nData);
-		for (size_t i = 0; i < nData; i++) {
-			vcull[i] = vall[ActiveData[i]];
-		}
-		return vcull;
-	}
 
 	Vector cull(const std::vector<double>& vall) const {
 		assert(ActiveData.size() == nData);
@@ -410,17 +455,6 @@ private:
 		return vcull;
 	}
 
-	Matrix cull(const Matrix& mall) const {
-		assert(ActiveData.size() == nData);
-		assert(mall.rows() == nAllData);
-		assert(mall.cols() == nParam);
-		Matrix mcull(nData, nParam);
-		for (size_t i = 0; i < nData; i++) {
-			mcull.row(i) = mall.row(ActiveData[i]);
-		}
-		return mcull;
-	}
-
 public:
 
 	const size_t& nsoundings() {
@@ -486,6 +520,10 @@ public:
 		std::string suffix = stringvalue(Rank, ".%04d");
 		OO.LogFile = insert_after_filename(OO.LogFile, suffix);
 		openlogfile(); //load this first to get outputlogfile opened
+		if (OO.Profile) {
+			sFilePathParts fpp = getfilepathparts(OO.LogFile);
+			Profiler.open(fpp.directory + fpp.prefix);
+		}
 
 		//Load control file
 		parse_options();
@@ -499,6 +537,9 @@ public:
 #endif			
 			//std::string s = IM->datafilename();
 		}
+		else if (cInputManager::iscolumnar(ib)) {
+			IM = std::make_unique<cColumnarInputManager>(ib);
+		}
 		else {
 			IM = std::make_unique<cASCIIInputManager>(ib);
 		}
@@ -526,6 +567,16 @@ public:
 		cMpiEnv::world_barrier();
 #endif
 
+		sFilePathParts fpp = getfilepathparts(OM->datafilename());
+		Journal.open(fpp.directory + fpp.prefix + ".journal", OO.Resume);
+		if (OO.Resume) {
+			if (cOutputManager::isnetcdf(ob) == false) {
+				//ASCII output is written asynchronously so the journal may be ahead of the data file
+				const std::string& df = OM->datafilename();
+				Journal.discard_beyond(std::filesystem::exists(df) ? (int64_t)std::filesystem::file_size(df) : 0);
+			}
+			OM->set_resume(Journal.resume_offset());
+		}
 		OM->opendatafile(IM->datafilename(), IM->subsamplerate());
 	}
 
@@ -676,6 +727,35 @@ public:
 			nBunchSubsample = 1;
 		}
 
+		CoarseToFine = b.getboolvalue("CoarseToFine");
+		if (b.getvalue("CoarseSubsample", CoarseSubsample) == false) {
+			CoarseSubsample = 10;
+		}
+		if (CoarseSubsample < 2) CoarseToFine = false;
+
+		CoarseReference = false;//default
+		std::string cm = b.getstringvalue("CoarseModelUsage");
+		if (!isdefined(cm)) {
+			CoarseReference = false;
+		}
+		else if (strcasecmp(cm, "Start") == 0) {
+			CoarseReference = false;
+		}
+		else if (strcasecmp(cm, "Reference") == 0) {
+			CoarseReference = true;
+		}
+		else {
+			glog.errormsg("Unknown CoarseModelUsage %s\n", cm.c_str());
+		}
+
+		//Give each process runs of consecutive records so the sounding cache is reused by overlapping bunches
+		//and, in coarse-to-fine mode, so that few coarse records are shared between processes
+		if (b.getvalue("JobBlockSize", JobBlockSize) == false) {
+			JobBlockSize = nSoundings > 1 ? 32 : 1;
+			if (CoarseToFine) JobBlockSize = std::max(JobBlockSize, 4 * CoarseSubsample);
+		}
+		if (JobBlockSize < 1) JobBlockSize = 1;
+
 		if (b.getvalue("ErrorAddition", ErrorAddition) == false) {
 			ErrorAddition = 0.0;
 		}
@@ -699,13 +779,90 @@ public:
 		else if (strcasecmp(nt, "L2") == 0) {
 			NormType = eNormType::L2;
 		}
+		else if (strcasecmp(nt, "Huber") == 0) {
+			NormType = eNormType::HUBER;
+		}
+		else if (strcasecmp(nt, "Ekblom") == 0) {
+			NormType = eNormType::EKBLOM;
+		}
 		else {
 			glog.errormsg("Unknown NormType %s\n", nt.c_str());
 		}
 
+		if (b.getvalue("HuberThreshold", HuberThreshold) == false) {
+			HuberThreshold = 1.345;
+		}
+
+		if (b.getvalue("EkblomPower", EkblomPower) == false) {
+			EkblomPower = 1.0;
+		}
+
+		if (b.getvalue("EkblomEpsilon", EkblomEpsilon) == false) {
+			EkblomEpsilon = 1e-4;
+		}
+
 		MaxIterations = b.getsizetvalue("MaximumIterations");
 		MinimumPhiD = b.getdoublevalue("MinimumPhiD");
 		MinimumImprovement = b.getdoublevalue("MinimumPercentageImprovement");
+
+		BroydenUpdate = false;//default
+		std::string ju = b.getstringvalue("JacobianUpdate");
+		if (!isdefined(ju)) {
+			BroydenUpdate = false;
+		}
+		else if (strcasecmp(ju, "Full") == 0) {
+			BroydenUpdate = false;
+		}
+		else if (strcasecmp(ju, "Broyden") == 0) {
+			BroydenUpdate = true;
+		}
+		else {
+			glog.errormsg("Unknown JacobianUpdate %s\n", ju.c_str());
+		}
+
+		if (b.getvalue("FullJacobianInterval", FullJacobianInterval) == false) {
+			FullJacobianInterval = 4;
+		}
+		if (FullJacobianInterval < 1) FullJacobianInterval = 1;
+
+		LinearSolver = eLinearSolver::CHOLESKY;//default
+		std::string ls = b.getstringvalue("LinearSolver");
+		if (!isdefined(ls)) {
+			LinearSolver = eLinearSolver::CHOLESKY;
+		}
+		else if (strcasecmp(ls, "Cholesky") == 0) {
+			LinearSolver = eLinearSolver::CHOLESKY;
+		}
+		else if (strcasecmp(ls, "CG") == 0) {
+			LinearSolver = eLinearSolver::CG;
+		}
+		else if (strcasecmp(ls, "LSQR") == 0) {
+			LinearSolver = eLinearSolver::LSQR;
+		}
+		else {
+			glog.errormsg("Unknown LinearSolver %s\n", ls.c_str());
+		}
+
+		if (b.getvalue("LinearSolverTolerance", LinearSolverTolerance) == false) {
+			LinearSolverTolerance = 1e-6;
+		}
+
+		if (b.getvalue("LinearSolverMaxIterations", LinearSolverMaxIterations) == false) {
+			LinearSolverMaxIterations = 0;
+		}
+
+		if (b.getvalue("TrialThreads", TrialThreads) == false) {
+			TrialThreads = 1;
+		}
+		if (TrialThreads < 1) TrialThreads = 1;
+#if defined _OPENMP
+		if (UsingOpenMP && TrialThreads > 1) {
+			glog.warningmsg(_SRC_, "TrialThreads ignored when already running one inversion per OpenMP thread\n");
+			TrialThreads = 1;
+		}
+#else
+		TrialThreads = 1;
+#endif
 	}
 
 	void parse_constraints(const cBlock& b) {
@@ -1498,6 +1655,25 @@ public:
 		initialise_CableLengthConstraint();
 		initialise_BoundsConstraint();
 		Wm = Wr + LCvcsmth.W + LCvcsim.W + LClatc.W + LClatg.W;
+		if (LinearSolver == eLinearSolver::LSQR) {
+			initialise_Rm();
+		}
+	}
+
+	void initialise_Rm() {
+		Eigen::LLT<Matrix> llt(Wm);
+		if (llt.info() == Eigen::NumericalIssue) {
+			//Wm is only semi-definite, so regularise the diagonal just enough to factor it
+			const double eps = 1e-12 * std::max(Wm.trace() / (double)nParam, 1.0);
+			llt.compute(Wm + eps * Matrix::Identity(nParam, nParam));
+		}
+		if (llt.info() != Eigen::Success) {
+			//The factor would be meaningless, so fall back to the square root of the diagonal
+			glog.warningmsg(_SRC_, "At %s: could not factor Wm for the LSQR solver, using the square root of its diagonal\n", bunch_id().c_str());
+			Rm = Wm.diagonal().cwiseMax(0.0).cwiseSqrt().asDiagonal();
+			return;
+		}
+		Rm = llt.matrixU();
 	}
 
 	void dump_W_matrices() {
@@ -1529,6 +1705,11 @@ public:
 		return _dindex_[si][sysi][ci][wi];
 	};
 
+	//Index into the culled (active) data, or -1 if the datum was culled
+	const int& aindex(const size_t& sampleindex, const size_t& systemindex, const size_t& componentindex, const size_t& windowindex) {
+		return ActiveIndex[dindex(sampleindex, systemindex, componentindex, windowindex)];
+	};
+
 	void initialise_systems()
 	{
 		set_fftw_lock();
@@ -1539,6 +1720,16 @@ public:
 			SV[sysi].initialise(B[sysi], nSoundings);
 			SV[sysi].set_units(IM.get());
 		}
+
+		//Each concurrent trial thread other than the first needs its own forward model engines
+		TrialSystems.resize(TrialThreads - 1);
+		for (size_t k = 0; k < TrialSystems.size(); k++) {
+			TrialSystems[k].resize(nSystems);
+			for (size_t sysi = 0; sysi < nSystems; sysi++) {
+				TrialSystems[k][sysi] = std::make_unique<cTDEmSystem>();
+				TrialSystems[k][sysi]->readsystemdescriptorfile(SV[sysi].SystemFile);
+			}
+		}
 		unset_fftw_lock();
 	}
 
@@ -1668,8 +1859,12 @@ public:
 
 		//Work out indices to be culled
 		ActiveData.clear();
+		ActiveIndex.assign(nAllData, -1);
 		for (size_t i = 0; i < nAllData; i++) {
-			if (!isnull(obs[i]) && !isnull(err[i])) ActiveData.push_back(i);
+			if (!isnull(obs[i]) && !isnull(err[i])) {
+				ActiveIndex[i] = (int)ActiveData.size();
+				ActiveData.push_back(i);
+			}
 		}
 		nData = ActiveData.size();
 
@@ -1948,31 +2143,35 @@ public:
 	}
 
 	void forwardmodel(const Vector& parameters, Vector& predicted) {
+		cScopedPhaseTimer timer(Profiler, ePhase::FORWARD);
 		Matrix dummy;
+		#pragma omp atomic
 		nForwards++;
-		forwardmodel_impl(parameters, predicted, dummy, false);
+		forwardmodel_impl(parameters, predicted, dummy, false, trial_engine());
 	}
 
 	void forwardmodel_and_jacobian(const Vector& parameters, Vector& predicted, Matrix& jacobian) {
+		cScopedPhaseTimer timer(Profiler, ePhase::JACOBIAN);
 		nForwards++;
 		nJacobians++;
+		JacobianVersion++;
 		forwardmodel_impl(parameters, predicted, jacobian, true);
 	}
 
-	void forwardmodel_impl(const Vector& parameters, Vector& predicted, Matrix& jacobian, bool computederivatives)
+	void forwardmodel_impl(const Vector& parameters, Vector& predicted, Matrix& jacobian, bool computederivatives, const size_t engine = 0)
 	{
-		Vector pred_all(nAllData);
-		Matrix J_all;
+		//Write straight into the culled rows, the resizes are no-ops once the caller's storage is sized
+		predicted.resize(nData);
 		if (computederivatives) {
-			J_all.resize(nAllData, nParam);
-			J_all.setZero();
+			jacobian.resize(nData, nParam);
+			jacobian.setZero();
 		}
 
 		std::vector<cEarth1D> ev = get_earth(parameters);
 		std::vector<cTDEmGeometry> gv = get_geometry(parameters);
 		for (size_t sysi = 0; sysi < nSystems; sysi++) {
 			cTDEmSystemInfo& S = SV[sysi];
-			cTDEmSystem& T = S.T;
+			cTDEmSystem& T = engine == 0 ? S.T : *TrialSystems[engine - 1][sysi];
 
 			std::vector<double> scalefactors = get_scalefactors(sysi, parameters);
 
@@ -2009,18 +2208,17 @@ public:
 
 				if (S.invertXPlusZ) {
 					for (size_t wi = 0; wi < nw; wi++) {
-						const int& di = dindex(si, sysi, XZAMP, wi);
-						pred_all[di] = xzfm[wi];
+						setactive(predicted, aindex(si, sysi, XZAMP, wi), xzfm[wi]);
 						if (S.CompInfo[1].Use) {
-							pred_all[dindex(si, sysi, YCOMP, wi)] = yfm[wi];
+							setactive(predicted, aindex(si, sysi, YCOMP, wi), yfm[wi]);
 						}
 					}
 				}
 				else {
 					for (size_t wi = 0; wi < nw; wi++) {
-						if (S.CompInfo[XCOMP].Use) pred_all[dindex(si, sysi, XCOMP, wi)] = xfm[wi];
-						if (S.CompInfo[YCOMP].Use) pred_all[dindex(si, sysi, YCOMP, wi)] = yfm[wi];
-						if (S.CompInfo[ZCOMP].Use) pred_all[dindex(si, sysi, ZCOMP, wi)] = zfm[wi];
+						if (S.CompInfo[XCOMP].Use) setactive(predicted, aindex(si, sysi, XCOMP, wi), xfm[wi]);
+						if (S.CompInfo[YCOMP].Use) setactive(predicted, aindex(si, sysi, YCOMP, wi), yfm[wi]);
+						if (S.CompInfo[ZCOMP].Use) setactive(predicted, aindex(si, sysi, ZCOMP, wi), zfm[wi]);
 					}
 				}
 
@@ -2045,7 +2243,7 @@ public:
 								if (ci != ZCOMP) {
 									zdrv *= 0.0;
 								}
-								fillMatrixColumn(J_all, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
+								fillMatrixColumn(jacobian, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
 							}
 						}
 					}
@@ -2062,7 +2260,7 @@ public:
 							//multiply by natural log(10) as parameters are in logbase10 units
 							const double f = log(10.0) * e.conductivity[li];
 							xdrv *= f; ydrv *= f; zdrv *= f;
-							fillMatrixColumn(J_all, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
+							fillMatrixColumn(jacobian, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
 						}
 					}
 
@@ -2077,7 +2275,7 @@ public:
 							//multiply by natural log(10) as parameters are in logbase10 units
 							double sf = log(10.0) * e.thickness[li];
 							xdrv *= sf; ydrv *= sf; zdrv *= sf;
-							fillMatrixColumn(J_all, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
+							fillMatrixColumn(jacobian, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
 						}
 					}
 
@@ -2089,7 +2287,7 @@ public:
 							T.setprimaryfields();
 							T.setsecondaryfields();
 							fillDerivativeVectors(S, xdrv, ydrv, zdrv);
-							fillMatrixColumn(J_all, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
+							fillMatrixColumn(jacobian, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
 						}
 
 						if (solve_geometry_element("txrx_dx")) {
@@ -2099,7 +2297,7 @@ public:
 							T.setprimaryfields();
 							T.setsecondaryfields();
 							fillDerivativeVectors(S, xdrv, ydrv, zdrv);
-							fillMatrixColumn(J_all, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
+							fillMatrixColumn(jacobian, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
 						}
 
 						if (solve_geometry_element("txrx_dy")) {
@@ -2109,7 +2307,7 @@ public:
 							T.setprimaryfields();
 							T.setsecondaryfields();
 							fillDerivativeVectors(S, xdrv, ydrv, zdrv);
-							fillMatrixColumn(J_all, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
+							fillMatrixColumn(jacobian, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
 						}
 
 						if (solve_geometry_element("txrx_dz")) {
@@ -2119,44 +2317,41 @@ public:
 							T.setprimaryfields();
 							T.setsecondaryfields();
 							fillDerivativeVectors(S, xdrv, ydrv, zdrv);
-							fillMatrixColumn(J_all, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
+							fillMatrixColumn(jacobian, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
 						}
 
 						if (solve_geometry_element("rx_pitch")) {
 							const size_t pindex = gindex(si, "rx_pitch");
 							T.drx_pitch(xfm, zfm, g.rx_pitch, xdrv, zdrv);
 							ydrv *= 0.0;
-							fillMatrixColumn(J_all, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
+							fillMatrixColumn(jacobian, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
 						}
 
 						if (solve_geometry_element("rx_roll")) {
 							const size_t pindex = gindex(si, "rx_roll");
 							T.drx_roll(yfm, zfm, g.rx_roll, ydrv, zdrv);
 							xdrv *= 0.0;
-							fillMatrixColumn(J_all, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
+							fillMatrixColumn(jacobian, si, sysi, pindex, xfm, yfm, zfm, xzfm, xdrv, ydrv, zdrv);
 						}
 					}
 				}
 			}
 		}
-		predicted = cull(pred_all);
-		if (computederivatives) jacobian = cull(J_all);
-
-		if (Verbose && computederivatives) {
-			//std::cerr << "\n-----------------\n";
-			//std::cerr << "J_all: It " << CIS.iteration + 1 << std::endl;			
-			//std::cerr << J_all;			
-			//std::cerr << "\n-----------------\n";
-		}
 
 		if (OO.Dump && computederivatives) {
 			const std::string dp = dumppath();
-			writetofile(J_all, dp + "J" + ".dat");
-			std::ofstream of(dp + "J1" + ".dat");
-			of << J_all;
+			writetofile(jacobian, dp + "J" + ".dat");
 		}
 	}
 
+	void setactive(Vector& v, const int& ai, const double& value) {
+		if (ai >= 0) v[ai] = value;
+	}
+
+	void setactive(Matrix& M, const int& ai, const size_t& pindex, const double& value) {
+		if (ai >= 0) M(ai, pindex) = value;
+	}
+
 	void fillDerivativeVectors(cTDEmSystemInfo& S, std::vector<double>& xdrv, std::vector<double>& ydrv, std::vector<double>& zdrv)
 	{
 		cTDEmSystem& T = S.T;
@@ -2172,21 +2367,22 @@ public:
 
 	void fillMatrixColumn(Matrix& M, const size_t& si, const size_t& sysi, const size_t& pindex, const std::vector<double>& xfm, const std::vector<double>& yfm, const std::vector<double>& zfm, const std::vector<double>& xzfm, const std::vector<double>& xdrv, const std::vector<double>& ydrv, const std::vector<double>& zdrv)
 	{
+		Profiler.count(eCounter::JACOBIANCOLUMNS);
 		const cTDEmSystemInfo& S = SV[sysi];
 		const size_t& nw = S.T.NumberOfWindows;
 		if (S.invertXPlusZ) {
 			for (size_t wi = 0; wi < nw; wi++) {
-				M(dindex(si, sysi, XZAMP, wi), pindex) = (xfm[wi] * xdrv[wi] + zfm[wi] * zdrv[wi]) / xzfm[wi];
+				setactive(M, aindex(si, sysi, XZAMP, wi), pindex, (xfm[wi] * xdrv[wi] + zfm[wi] * zdrv[wi]) / xzfm[wi]);
 				if (S.CompInfo[1].Use) {
-					M(dindex(si, sysi, YCOMP, wi), pindex) = ydrv[wi];
+					setactive(M, aindex(si, sysi, YCOMP, wi), pindex, ydrv[wi]);
 				}
 			}
 		}
 		else {
 			for (size_t wi = 0; wi < nw; wi++) {
-				if (S.CompInfo[XCOMP].Use)M(dindex(si, sysi, XCOMP, wi), pindex) = xdrv[wi];
-				if (S.CompInfo[YCOMP].Use)M(dindex(si, sysi, YCOMP, wi), pindex) = ydrv[wi];
-				if (S.CompInfo[ZCOMP].Use)M(dindex(si, sysi, ZCOMP, wi), pindex) = zdrv[wi];
+				if (S.CompInfo[XCOMP].Use) setactive(M, aindex(si, sysi, XCOMP, wi), pindex, xdrv[wi]);
+				if (S.CompInfo[YCOMP].Use) setactive(M, aindex(si, sysi, YCOMP, wi), pindex, ydrv[wi]);
+				if (S.CompInfo[ZCOMP].Use) setactive(M, aindex(si, sysi, ZCOMP, wi), pindex, zdrv[wi]);
 			}
 		}
 	}
@@ -2198,6 +2394,7 @@ public:
 
 	bool read_bunch(const size_t& record) {
 		_GSTITEM_
+		cScopedPhaseTimer timer(Profiler, ePhase::INPUT);
 
 			bool bunchstatus = false;
 		int fi = AncFld[0].keyindex("line");
@@ -2215,8 +2412,17 @@ public:
 			return bunchstatus;
 		}
 
+		//Records are visited in increasing order so anything before this bunch will not be needed again
+		SoundingCache.erase(SoundingCache.begin(), SoundingCache.lower_bound(Bunch.record(0)));
+
 		for (size_t si = 0; si < Bunch.size(); si++) {
 			const size_t& record = Bunch.record(si);
+			auto it = SoundingCache.find(record);
+			if (it != SoundingCache.end()) {
+				restore_sounding(si, it->second);
+				continue;
+			}
+
 			bool loadstatus = IM->load_record(record);
 			if (loadstatus == false) {
 				OutputMessage += ", Skipping - could not load record";
@@ -2232,18 +2438,33 @@ public:
 				OutputMessage += ", Skipping - could not read record";
 				return false;
 			}
+
+			//bookmark
+			for (size_t sysi = 0; sysi < SV.size(); sysi++) {
+				cTDEmSystemInfo& S = SV[sysi];
+				for (size_t ci = 0; ci < 3; ci++) {
+					cTDEmComponentInfo& C = S.CompInfo[ci];
+					if (C.fdSF.solve) {
+						IM->read(C.fdSF.ref, C.SF.ref);
+						IM->read(C.fdSF.std, C.SF.std);
+						IM->read(C.fdSF.min, C.SF.min);
+						IM->read(C.fdSF.max, C.SF.max);
+					}
+				}
+			}
+			SoundingCache[record] = cache_sounding(si);
 		}
 
-		//bookmark
+		//Scaling factor references come from the last record in the bunch
+		const cCachedSounding& last = SoundingCache[Bunch.record(Bunch.size() - 1)];
 		for (size_t sysi = 0; sysi < SV.size(); sysi++) {
-			cTDEmSystemInfo& S = SV[sysi];
 			for (size_t ci = 0; ci < 3; ci++) {
-				cTDEmComponentInfo& C = S.CompInfo[ci];
+				cTDEmComponentInfo& C = SV[sysi].CompInfo[ci];
 				if (C.fdSF.solve) {
-					IM->read(C.fdSF.ref, C.SF.ref);
-					IM->read(C.fdSF.std, C.SF.std);
-					IM->read(C.fdSF.min, C.SF.min);
-					IM->read(C.fdSF.max, C.SF.max);
+					C.SF.ref = last.sf[sysi][ci].ref;
+					C.SF.std = last.sf[sysi][ci].std;
+					C.SF.min = last.sf[sysi][ci].min;
+					C.SF.max = last.sf[sysi][ci].max;
 				}
 			}
 		}
@@ -2251,6 +2472,41 @@ public:
 		return true;
 	}
 
+	cCachedSounding cache_sounding(const size_t& bunchsoundingindex) const {
+		const size_t& si = bunchsoundingindex;
+		cCachedSounding cs;
+		cs.id = Id[si];
+		cs.anc = AncFld[si];
+		cs.g = G[si];
+		cs.e = E[si];
+		cs.data.resize(nSystems);
+		cs.sf.resize(nSystems);
+		for (size_t sysi = 0; sysi < nSystems; sysi++) {
+			cs.data[sysi].resize(3);
+			cs.sf[sysi].resize(3);
+			for (size_t ci = 0; ci < 3; ci++) {
+				const cTDEmComponentInfo& C = SV[sysi].CompInfo[ci];
+				if (C.Use) cs.data[sysi][ci] = C.data[si];
+				cs.sf[sysi][ci] = C.SF;
+			}
+		}
+		return cs;
+	}
+
+	void restore_sounding(const size_t& bunchsoundingindex, const cCachedSounding& cs) {
+		const size_t& si = bunchsoundingindex;
+		Id[si] = cs.id;
+		AncFld[si] = cs.anc;
+		G[si] = cs.g;
+		E[si] = cs.e;
+		for (size_t sysi = 0; sysi < nSystems; sysi++) {
+			for (size_t ci = 0; ci < 3; ci++) {
+				cTDEmComponentInfo& C = SV[sysi].CompInfo[ci];
+				if (C.Use) C.data[si] = cs.data[sysi][ci];
+			}
+		}
+	}
+
 	bool read_record(const size_t& bunchsoundingindex) {
 		const size_t& si = bunchsoundingindex;
 		bool readstatus = true;
@@ -2469,6 +2725,8 @@ public:
 		nJacobians = 0;
 		OutputMessage = "";
 		CIS = cIterationState();
+		StartParam.resize(0);
+		StartLambda = 0.0;
 		bool status = initialise_bunch_data();
 		if (status == false) return false;
 		initialise_bunch_parameters();
@@ -2485,6 +2743,11 @@ public:
 		CIS.iteration = 0;
 		//CIS.lambda = 1e8;
 		CIS.param = RefParam;
+		if ((size_t)StartParam.size() == nParam) {
+			CIS.param = clamp_to_bounds(StartParam);
+		}
+		//A warm started inversion is already close so may stop on small improvement straight away
+		const size_t minimprovementiteration = StartLambda > 0.0 ? 1 : 10;
 		forwardmodel(CIS.param, CIS.pred);
 		CIS.phid = phiData(CIS.pred);
 		CIS.targetphid = CIS.phid;
@@ -2493,6 +2756,10 @@ public:
 
 		double percentimprovement = 100.0;
 		bool   keepiterating = true;
+		bool   forcefulljacobian = true;
+		bool   jacobianiscurrent = false;//J is exact at CIS.param
+		bool   jacobianfreegeometry = FreeGeometry;
+		size_t lastfulljacobian = 0;
 		while (keepiterating == true) {
 			if (Verbose && nScalingParam > 0) {
 				std::vector<double> scalefactors = get_scalefactors(0, CIS.param);
@@ -2515,7 +2782,7 @@ public:
 				keepiterating = false;
 				TerminationReason = "No improvement";
 			}
-			else if (CIS.iteration > 10 && percentimprovement < MinimumImprovement) {
+			else if (CIS.iteration > minimprovementiteration && percentimprovement < MinimumImprovement) {
 				keepiterating = false;
 				TerminationReason = "Small % improvement";
 			}
@@ -2526,10 +2793,25 @@ public:
 				if (CIS.iteration + 1 >= BeginGeometrySolveIteration) FreeGeometry = true;
 				else FreeGeometry = false;
 
+				//Between full recomputes J holds the secant updated approximation
+				bool fulljacobian = true;
+				if (BroydenUpdate && forcefulljacobian == false && CIS.iteration > 0) {
+					if (FreeGeometry == jacobianfreegeometry && CIS.iteration - lastfulljacobian < FullJacobianInterval) {
+						fulljacobian = false;
+					}
+				}
+
 				Vector g;
-				forwardmodel_and_jacobian(CIS.param, g, J);
+				if (fulljacobian) {
+					forwardmodel_and_jacobian(CIS.param, g, J);
+					jacobianiscurrent = true;
+					forcefulljacobian = false;
+					jacobianfreegeometry = FreeGeometry;
+					lastfulljacobian = CIS.iteration;
+				}
+
 				if (CIS.iteration == 0) {
-					CIS.lambda = 1e8;
+					CIS.lambda = StartLambda > 0.0 ? StartLambda : 1e8;
 					if (OO.Dump) {
 						dump_first_iteration();
 						dump_iteration(CIS);
@@ -2546,6 +2828,10 @@ public:
 				percentimprovement = 100.0 * (CIS.phid - phid) / (CIS.phid);
 
 				if (phid <= CIS.phid) {
+					jacobianiscurrent = false;
+					if (BroydenUpdate) {
+						broyden_update(m - CIS.param, g - CIS.pred);
+					}
 					CIS.iteration++;
 					CIS.param = m;
 					CIS.pred = g;
@@ -2555,6 +2841,12 @@ public:
 					CIS.phim = phiModel(CIS.param);
 					if (OO.Dump) dump_iteration(CIS);
 				}
+
+				if (fulljacobian == false && percentimprovement < MinimumImprovement) {
+					//Progress has stalled on the approximate Jacobian so recompute it before testing for termination
+					forcefulljacobian = true;
+					percentimprovement = 100.0;
+				}
 			}
 		}
 
@@ -2566,33 +2858,216 @@ public:
 		}
 
 		set_predicted(CIS.param);
-		forwardmodel_and_jacobian(CIS.param, CIS.pred, J);
-		ParameterSensitivity = compute_parameter_sensitivity();
-		ParameterUncertainty = compute_parameter_uncertainty();
+		if (OO.ParameterSensitivity || OO.ParameterUncertainty || OO.Dump) {
+			//A rejected final step leaves the Jacobian already evaluated at the final model
+			if (jacobianiscurrent == false) {
+				forwardmodel_and_jacobian(CIS.param, CIS.pred, J);
+			}
+			ParameterSensitivity = compute_parameter_sensitivity();
+			ParameterUncertainty = compute_parameter_uncertainty();
+		}
+	}
+
+	size_t integrand_calls() const {
+		size_t n = 0;
+		for (size_t sysi = 0; sysi < nSystems; sysi++) {
+			n += SV[sysi].T.LEM.total_integrand_calls();
+			for (size_t k = 0; k < TrialSystems.size(); k++) {
+				n += TrialSystems[k][sysi]->LEM.total_integrand_calls();
+			}
+		}
+		return n;
+	}
+
+	void broyden_update(const Vector& dm, const Vector& dg)
+	{
+		//Rank-one secant update J = J + (dg - J dm) dm' / (dm' dm)
+		const double dmtdm = dm.dot(dm);
+		if (dmtdm <= 0.0) return;
+		const Vector r = (dg - J * dm) / dmtdm;
+
+		//Carry J'VJ across to the updated J with the same weights V, which costs
+		//O(nData nParam) rather than the O(nData nParam^2) of rebuilding it
+		//(J + r dm')'V(J + r dm') = J'VJ + a dm' + dm a' + (r'Vr) dm dm', where a = J'Vr
+		const bool normalcurrent = NE.JacobianVersion == JacobianVersion && (size_t)NE.V.size() == nData;
+
+		if (normalcurrent) {
+			const Vector vr = NE.V.cwiseProduct(r);
+			const Vector a = J.transpose() * vr;
+			const double c = r.dot(vr);
+			NE.JtVJ.noalias() += a * dm.transpose();
+			NE.JtVJ.noalias() += dm * a.transpose();
+			NE.JtVJ.noalias() += c * (dm * dm.transpose());
+		}
+
+		J.noalias() += r * dm.transpose();
+		JacobianVersion++;
+		if (normalcurrent) NE.JacobianVersion = JacobianVersion;
+	}
+
+	Vector clamp_to_bounds(const Vector& m) const {
+		static const double ud = undefinedvalue<double>();
+		Vector c = m;
+		for (size_t pi = 0; pi < nParam; pi++) {
+			if (Param_Min[pi] == ud) continue;
+			c[pi] = std::min(std::max(c[pi], Param_Min[pi]), Param_Max[pi]);
+		}
+		return c;
+	}
+
+	int job_record(const int& paralleljob) const {
+		return ((int)StartRecord - 1) + paralleljob * (int)IM->subsamplerate();
+	}
+
+	bool is_my_job(const int& paralleljob) const {
+		if (((paralleljob / (int)JobBlockSize) % Size) != Rank) return false;
+		return Journal.completed((size_t)job_record(paralleljob)) == false;
+	}
+
+	void coarse_pass() {
+		//Invert every CoarseSubsample'th job that brackets at least one job still to be done by this process
+		glog.logmsg(0, "Coarse pass inverting every %zu'th record\n", CoarseSubsample);
+		const int C = (int)CoarseSubsample;
+		bool readstatus = true;
+		for (int anchor = 0; readstatus; anchor += C) {
+			const int record = job_record(anchor);
+			if (record > (EndRecord - 1))break;
+
+			bool needed = false;
+			for (int j = std::max(anchor - C + 1, 0); j < anchor + C; j++) {
+				if (is_my_job(j)) {
+					needed = true;
+					break;
+				}
+			}
+			if (needed == false) continue;
+
+			std::ostringstream s;
+			Profiler.begin_record();
+			if ((readstatus = read_bunch(record))) {
+				s << bunch_id();
+				std::string status = "coarse_skipped";
+				if (initialise_bunch()) {
+					double t1 = gettime();
+					iterate();
+					double t2 = gettime();
+					store_coarse_model((size_t)record);
+					status = "coarse";
+					s << bunch_result(t2 - t1) << " Coarse";
+				}
+				Profiler.end_record((size_t)record, status);
+				s << std::endl;
+				glog.logmsg(s.str());
+			}
+		}
+	}
+
+	void store_coarse_model(const size_t& record) {
+		const size_t si = Bunch.master_index();
+		cCoarseModel c;
+		c.line = Id[si].line;
+		c.sounding = CIS.param.segment(si * nParamPerSounding, nParamPerSounding);
+		c.scaling = CIS.param.segment(nParamPerSounding * nSoundings, nScalingParam);
+		c.lambda = CIS.lambda;
+		CoarseModels[record] = c;
+	}
+
+	//Coarse models on the same line either side of the record (both null if there are none) and the interpolation weight w
+	std::pair<const cCoarseModel*, const cCoarseModel*> coarse_neighbours(const size_t& record, const int& line, double& w) const {
+		const cCoarseModel* lo = nullptr;
+		const cCoarseModel* hi = nullptr;
+		size_t rlo = 0, rhi = 0;
+		auto it = CoarseModels.upper_bound(record);
+		if (it != CoarseModels.end() && it->second.line == line) {
+			hi = &it->second;
+			rhi = it->first;
+		}
+		if (it != CoarseModels.begin()) {
+			--it;
+			if (it->second.line == line) {
+				lo = &it->second;
+				rlo = it->first;
+			}
+		}
+
+		w = 0.0;
+		if (lo == nullptr) lo = hi;
+		else if (hi == nullptr) hi = lo;
+		else w = (double)(record - rlo) / (double)(rhi - rlo);
+		return { lo, hi };
+	}
+
+	void set_coarse_start_model() {
+		//Linearly interpolate the coarse models along line for each sounding in the bunch
+		Vector m = RefParam;
+		bool found = false;
+		double loglambda = 0.0;
+		for (size_t si = 0; si < nSoundings; si++) {
+			double w;
+			auto n = coarse_neighbours(Bunch.record(si), Id[si].line, w);
+			if (n.first == nullptr) continue;
+			m.segment(si * nParamPerSounding, nParamPerSounding) = (1.0 - w) * n.first->sounding + w * n.second->sounding;
+			if (si == Bunch.master_index()) {
+				m.segment(nParamPerSounding * nSoundings, nScalingParam) = (1.0 - w) * n.first->scaling + w * n.second->scaling;
+				loglambda = (1.0 - w) * std::log10(n.first->lambda) + w * std::log10(n.second->lambda);
+				found = true;
+			}
+		}
+		if (found == false) return;
+
+		StartParam = m;
+		StartLambda = pow10(loglambda);
+		if (CoarseReference) RefParam = m;
+	}
+
+	//Buffered output managers may hold a record's output in memory for a while, so it is only journaled once it is in the file
+	void journal_record(const size_t& record, const std::string& status) {
+		PendingJournal.push_back({ record, status, OM->tell(), OM->points_ended() });
+		journal_durable();
+	}
+
+	void journal_durable() {
+		const size_t durable = OM->durable_points();
+		while (PendingJournal.size() > 0 && PendingJournal.front().point <= durable) {
+			const cCompletionJournal::cPending& p = PendingJournal.front();
+			Journal.record(p.record, p.status, p.offset);
+			PendingJournal.pop_front();
+		}
 	}
 
 	int execute() {
 		_GSTITEM_
+		if (CoarseToFine) coarse_pass();
+
 			bool readstatus = true;
 		int paralleljob = 0;
 		do {
-			int record = ((int)StartRecord - 1) + paralleljob * (int)IM->subsamplerate();
+			int record = job_record(paralleljob);
 			if (record > (EndRecord - 1))break;
-			if ((paralleljob % Size) == Rank) {
+			if (is_my_job(paralleljob)) {
 				std::ostringstream s;
+				Profiler.begin_record();
+				const size_t nintegrands = integrand_calls();
 				if ((readstatus = read_bunch(record))) {
 					s << bunch_id();
+					std::string status;
 					if (initialise_bunch()) {
+						if (CoarseToFine) set_coarse_start_model();
 						double t1 = gettime();
 						iterate();
 						double t2 = gettime();
 						double etime = t2 - t1;
 						write_result(record);
+						status = "ok";
 						s << bunch_result(etime);
 					}
 					else {
 						OutputMessage += ", Skipping - could not initialise the bunch";
+						status = "skipped";
 					}
+					journal_record((size_t)record, status);
+					Profiler.count(eCounter::INTEGRANDCALLS, integrand_calls() - nintegrands);
+					Profiler.end_record((size_t)record, status);
 					s << std::endl;
 					if (OutputMessage.size() > 0) {
 						std::cerr << s.str();
@@ -2602,6 +3077,10 @@ public:
 			}
 			paralleljob++;
 		} while (readstatus == true);
+		OM->closedatafile();
+		journal_durable();
+		Journal.close();
+		Profiler.close();
 		glog.close();
 		return 0;
 	}
@@ -2629,7 +3108,7 @@ public:
 
 	double estimate_initial_lambda()
 	{
-		Matrix JtWdJ = J.transpose() * Wd * J;
+		const Matrix JtWdJ = J.transpose() * Wd.diagonal().asDiagonal() * J;
 
 		Eigen::JacobiSVD<Matrix> svd0(JtWdJ);
 		Vector s0 = svd0.singularValues();
@@ -2645,6 +3124,14 @@ public:
 
 	Vector solve_linear_system(const double& lambda, const Vector& param, const Vector& pred)
 	{
+		cScopedPhaseTimer timer(Profiler, ePhase::LINEARSOLVE);
+		if (LinearSolver == eLinearSolver::CG) {
+			return solve_linear_system_cg(lambda, param, pred);
+		}
+		else if (LinearSolver == eLinearSolver::LSQR) {
+			return solve_linear_system_lsqr(lambda, param, pred);
+		}
+
 		// Phi = (d-g(m)+Jm) Wd (d-g(m)+Jm) + lambda ( (m-m0)' Wr (m-m0) + m' Ws m) )
 		//Ax = b
 		//A = [J'WdJ + lambda (Wr + Ws)]
@@ -2656,22 +3143,11 @@ public:
 		const Vector& m = param;
 		const Vector& g = pred;
 		const Vector& d = Obs;
-		const Vector& e = Err;
 		const Vector& m0 = RefParam;
 
-		Matrix V = Wd;
-		if (NormType == eNormType::L1) {
-			for (size_t i = 0; i < nData; i++) {
-				const double r = (d[i] - g[i]) / e[i];
-				V(i, i) *= 1.0 / std::abs(r);
-			}
-		}
-
-		Matrix JtV = J.transpose() * V;
-		Matrix JtVJ = JtV * J;
-		
-		Matrix A = JtVJ + lambda * Wm;
-		Vector b = JtV * (d - g + J * m);
+		const Vector v = data_weights(g);
+		Matrix A = weighted_normal_matrix(v) + lambda * Wm;
+		Vector b = J.transpose() * v.cwiseProduct(d - g + J * m);
 		b += lambda * (Wr * m0);
 
 		if (LClatg.operates_on_difference_from_reference_model()) {
@@ -2703,8 +3179,234 @@ public:
 		return x;
 	}
 
+	Vector data_weights(const Vector& pred) const
+	{
+		//Diagonal of the (possibly IRLS reweighted) data weighting matrix
+		Vector v = Wd.diagonal();
+		if (NormType != eNormType::L2) {
+			for (size_t i = 0; i < nData; i++) {
+				const double r = (Obs[i] - pred[i]) / Err[i];
+				v[i] *= irls_weight(r);
+			}
+		}
+		return v;
+	}
+
+	const Matrix& weighted_normal_matrix(const Vector& v)
+	{
+		//J'VJ is reused across the lambda trials of an iteration. Across iterations it is
+		//carried over by broyden_update(), so J is unchanged but the IRLS weights have moved
+		//and only the rows whose weights have changed are updated
+		if (NE.JacobianVersion == JacobianVersion && NE.V.size() == v.size()) {
+			std::vector<size_t> changed;
+			for (size_t i = 0; i < nData; i++) {
+				if (v[i] != NE.V[i]) changed.push_back(i);
+			}
+			if (changed.size() * 4 < nData) {
+				for (const size_t& i : changed) {
+					NE.JtVJ.noalias() += (v[i] - NE.V[i]) * (J.row(i).transpose() * J.row(i));
+				}
+				NE.V = v;
+				return NE.JtVJ;
+			}
+		}
+
+		NE.JtVJ.noalias() = J.transpose() * v.asDiagonal() * J;
+		NE.V = v;
+		NE.JacobianVersion = JacobianVersion;
+		return NE.JtVJ;
+	}
+
+	Vector model_rhs() const
+	{
+		Vector h = Wr * RefParam;
+		if (LClatg.operates_on_difference_from_reference_model()) {
+			h += LClatg.W * RefParam;
+		}
+		return h;
+	}
+
+	size_t linear_solver_max_iterations() const
+	{
+		if (LinearSolverMaxIterations > 0) return LinearSolverMaxIterations;
+		return nParam;
+	}
+
+	Vector solve_linear_system_cg(const double& lambda, const Vector& param, const Vector& pred)
+	{
+		//Jacobi preconditioned conjugate gradients on the same normal equations
+		//as the Cholesky solver, but J'VJ is only ever applied as J'(V(Jp))
+		const Vector& m = param;
+		const Vector& g = pred;
+		const Vector& d = Obs;
+		const Vector v = data_weights(g);
+
+		Vector b = J.transpose() * v.cwiseProduct(d - g + J * m);
+		b += lambda * model_rhs();
+		Vector dg = J.array().square().matrix().transpose() * v;
+		dg += lambda * Wm.diagonal();
+
+		cNonLinearConstraint& CL = NLCcablen;
+		cNonLinearConstraint& CB = NLCbounds;
+		Vector wcl, wcb;
+		if (CL.alpha > 0) {
+			CableLengthConstraint_jacobian(m);
+			Vector predicted = CableLengthConstraint_forward(m);
+			wcl = CL.W.diagonal();
+			b += CL.J.transpose() * wcl.cwiseProduct(CL.data - predicted + CL.J * m);
+			dg += CL.J.array().square().matrix().transpose() * wcl;
+		}
+
+		if (CB.alpha > 0) {
+			BoundsConstraint_jacobian(m);
+			Vector predicted = BoundsConstraint_forward(m);
+			wcb = CB.W.diagonal();
+			b += CB.J.transpose() * wcb.cwiseProduct(CB.data - predicted + CB.J * m);
+			dg += CB.J.array().square().matrix().transpose() * wcb;
+		}
+
+		auto Aprod = [&](const Vector& p) {
+			Vector q = J.transpose() * v.cwiseProduct(J * p);
+			q += lambda * (Wm * p);
+			if (CL.alpha > 0) q += CL.J.transpose() * wcl.cwiseProduct(CL.J * p);
+			if (CB.alpha > 0) q += CB.J.transpose() * wcb.cwiseProduct(CB.J * p);
+			return q;
+		};
+
+		Vector dinv(nParam);
+		for (size_t i = 0; i < nParam; i++) {
+			dinv[i] = dg[i] > 0.0 ? 1.0 / dg[i] : 1.0;
+		}
+
+		//Warm start from the current model
+		Vector x = m;
+		Vector r = b - Aprod(x);
+		Vector z = dinv.cwiseProduct(r);
+		Vector p = z;
+		double rz = r.dot(z);
+		const double tol = LinearSolverTolerance * b.norm();
+		const size_t maxits = linear_solver_max_iterations();
+		for (size_t k = 0; k < maxits; k++) {
+			if (r.norm() <= tol) break;
+			const Vector q = Aprod(p);
+			const double pq = p.dot(q);
+			if (pq <= 0.0) {
+				std::cerr << "\nAt " << bunch_id() << ": CG encountered a non positive definite system" << std::endl;
+				break;
+			}
+			const double alpha = rz / pq;
+			x += alpha * p;
+			r -= alpha * q;
+			z = dinv.cwiseProduct(r);
+			const double rznew = r.dot(z);
+			p = z + (rznew / rz) * p;
+			rz = rznew;
+		}
+		return x;
+	}
+
+	Vector solve_linear_system_lsqr(const double& lambda, const Vector& param, const Vector& pred)
+	{
+		//LSQR (Paige and Saunders, 1982) on the stacked least squares form of the normal equations
+		//    [ V^1/2 J          ]     [ V^1/2 (d - g + Jm)            ]
+		//    [ lambda^1/2 Rm    ] x = [ lambda^1/2 Rm'^-1 h           ]
+		//    [ Wc^1/2 Jc        ]     [ Wc^1/2 (dc - gc + Jc m)       ]
+		//solved for the update from m so an early termination still gives a sensible step
+		const Vector& m = param;
+		const Vector& g = pred;
+		const Vector& d = Obs;
+		const Vector sv = data_weights(g).cwiseSqrt();
+		const double sl = std::sqrt(lambda);
+
+		cNonLinearConstraint& CL = NLCcablen;
+		cNonLinearConstraint& CB = NLCbounds;
+		const size_t ncl = CL.alpha > 0 ? (size_t)CL.J.rows() : 0;
+		const size_t ncb = CB.alpha > 0 ? (size_t)CB.J.rows() : 0;
+		const size_t nrows = nData + nParam + ncl + ncb;
+
+		Vector u0(nrows);
+		u0.segment(0, nData) = sv.cwiseProduct(d - g + J * m);
+		u0.segment(nData, nParam) = sl * Rm.transpose().triangularView<Eigen::Lower>().solve(model_rhs());
+
+		Vector swcl, swcb;
+		if (ncl > 0) {
+			CableLengthConstraint_jacobian(m);
+			Vector predicted = CableLengthConstraint_forward(m);
+			swcl = CL.W.diagonal().cwiseSqrt();
+			u0.segment(nData + nParam, ncl) = swcl.cwiseProduct(CL.data - predicted + CL.J * m);
+		}
+
+		if (ncb > 0) {
+			BoundsConstraint_jacobian(m);
+			Vector predicted = BoundsConstraint_forward(m);
+			swcb = CB.W.diagonal().cwiseSqrt();
+			u0.segment(nData + nParam + ncl, ncb) = swcb.cwiseProduct(CB.data - predicted + CB.J * m);
+		}
+
+		auto Kprod = [&](const Vector& x) {
+			Vector y(nrows);
+			y.segment(0, nData) = sv.cwiseProduct(J * x);
+			const Vector rx = Rm.triangularView<Eigen::Upper>() * x;
+			y.segment(nData, nParam) = sl * rx;
+			if (ncl > 0) y.segment(nData + nParam, ncl) = swcl.cwiseProduct(CL.J * x);
+			if (ncb > 0) y.segment(nData + nParam + ncl, ncb) = swcb.cwiseProduct(CB.J * x);
+			return y;
+		};
+
+		auto Ktprod = [&](const Vector& y) {
+			Vector x = J.transpose() * sv.cwiseProduct(y.segment(0, nData));
+			const Vector rty = Rm.transpose().triangularView<Eigen::Lower>() * y.segment(nData, nParam);
+			x += sl * rty;
+			if (ncl > 0) x += CL.J.transpose() * swcl.cwiseProduct(y.segment(nData + nParam, ncl));
+			if (ncb > 0) x += CB.J.transpose() * swcb.cwiseProduct(y.segment(nData + nParam + ncl, ncb));
+			return x;
+		};
+
+		Vector dx = Vector::Zero(nParam);
+		Vector u = u0 - Kprod(m);
+		double beta = u.norm();
+		if (beta == 0.0) return m;
+		u /= beta;
+
+		Vector v = Ktprod(u);
+		double alpha = v.norm();
+		if (alpha == 0.0) return m;
+		v /= alpha;
+
+		Vector w = v;
+		double phibar = beta;
+		double rhobar = alpha;
+		const double tol = LinearSolverTolerance * alpha * beta;
+		const size_t maxits = linear_solver_max_iterations();
+		for (size_t k = 0; k < maxits; k++) {
+			u = Kprod(v) - alpha * u;
+			beta = u.norm();
+			if (beta > 0.0) u /= beta;
+
+			v = Ktprod(u) - beta * v;
+			alpha = v.norm();
+			if (alpha > 0.0) v /= alpha;
+
+			const double rho = std::hypot(rhobar, beta);
+			const double c = rhobar / rho;
+			const double s = beta / rho;
+			const double theta = s * alpha;
+			rhobar = -c * alpha;
+			const double phi = c * phibar;
+			phibar = s * phibar;
+
+			dx += (phi / rho) * w;
+			w = v - (theta / rho) * w;
+
+			//Estimate of the normal equations residual norm |K'r|
+			if (phibar * alpha * std::abs(c) <= tol) break;
+		}
+		return m + dx;
+	}
+
 	void write_result(const int& pointindex)
 	{
+		cScopedPhaseTimer timer(Profiler, ePhase::OUTPUT);
 		const Vector& m = CIS.param;
 		const Vector& m0 = RefParam;
 
@@ -22,6 +22,7 @@ Author: Ross C. Brodie, Geoscience Australia.
 #include "vector_utils.h"
 #include "cinverter.h"
 #include "csbsinverter.h"
+#include "outputmerger.h"
 #include "stacktrace.h"
 #include "logger.h"
 #include "streamredirecter.h"
@@ -49,6 +50,14 @@ int finaliseandexit() {
 	return EXIT_FAILURE;
 }
 
+void merge_outputs(const std::string& controlfile, const int& size) {
+	cBlock ob = cBlock(controlfile).findblock("Output");
+	if (cOutputMerger::required(ob, size)) {
+		cOutputMerger m(ob, size);
+		m.merge();
+	}
+}
+
 int main(int argc, char** argv) {
 	std::string commandline = commandlinestring(argc, argv);
 	glog.logmsg(0, "%s\n", commandline.c_str());
@@ -129,14 +138,18 @@ int main(int argc, char** argv) {
 			int openmprank = omp_get_thread_num();
 			std::unique_ptr<cInverter> I = std::make_unique<cSBSInverter>(controlfile, openmpsize, openmprank, usingopenmp, commandline);
 		}
+		merge_outputs(controlfile, openmpsize);
 		std::cerr << "Warning log closing " << timestamp() << std::endl;
 #endif
 	}
 	else {
-		std::unique_ptr<cInverter> I = std::make_unique<cSBSInverter>(controlfile, mpisize, mpirank, usingopenmp, commandline);
+		{
+			std::unique_ptr<cInverter> I = std::make_unique<cSBSInverter>(controlfile, mpisize, mpirank, usingopenmp, commandline);
+		}
 #ifdef ENABLE_MPI
 		cMpiEnv::world_barrier();
 #endif
+		if (mpirank == 0) merge_outputs(controlfile, mpisize);
 		if (mpirank == 0) std::cerr << "Warning log closing " << timestamp() << std::endl;
 	}
 
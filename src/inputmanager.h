@@ -12,6 +12,8 @@ Author: Ross C. Brodie, Geoscience Australia.
 #include "samplebunch.h"
 #include "asciicolumnfile.h"
 #include "fielddefinition.h"
+#include "mappedrecordfile.h"
+#include "columnarfile.h"
 #if defined HAVE_NETCDF
 #include "geophysics_netcdf.hpp"
 #endif
@@ -19,7 +21,7 @@ Author: Ross C. Brodie, Geoscience Australia.
 class cInputManager {
 
 public:
-	enum class IOType { ASCII, NETCDF, NONE };
+	enum class IOType { ASCII, NETCDF, COLUMNAR, NONE };
 
 protected:
 	std::string DataFileName;
@@ -50,6 +52,15 @@ public:
 		return false;
 	}
 
+	static bool iscolumnar(const cBlock& b) {
+		std::string fname = b.getstringvalue("DataFile");
+		std::string ext = extractfileextension(fname);
+		if (strcasecmp(ext, ".gcol") == 0) {
+			return true;
+		}
+		return false;
+	}
+
 	size_t subsamplerate() { return Subsample; }
 
 	virtual bool is_record_valid() { return true; }
@@ -64,6 +75,70 @@ public:
 
 	virtual bool parse_record() { return true; }
 
+	template<typename T>
+	bool get_one(const cFieldDefinition& fd, const size_t& pointindex, T& val) {
+		if (load_record(pointindex)) {
+			if (parse_record()) {
+				if (fd.isinitialised()) {
+					if (read(fd, val)) {
+						return true;
+					};
+				}
+				else {
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	//Soundings around pointindex that have the same line number, for the record oriented readers
+	bool get_bunch_by_line(cSampleBunch& bunch, const cFieldDefinition& fd, const int& pointindex, const int& bunchsize, const int& bunchsubsample)
+	{
+		int line;
+		bool status = get_one(fd, pointindex, line);
+
+		if (status == false) return false;
+
+		int pn = pointindex;
+		int ln = line;
+
+		int pa = pointindex - bunchsubsample * ((bunchsize - 1) / 2);
+		while (pa < 0) pa += bunchsubsample;
+		pn = pointindex - bunchsubsample;
+		if (pn < pa) pn = pa;
+
+		while (pn > pa) {
+			bool status = get_one(fd, pn, ln);
+			if (status && ln == line) {
+				pn -= bunchsubsample;
+			}
+			else {
+				pa = pn + bunchsubsample;
+				break;
+			}
+		}
+
+		int pb = pa + bunchsubsample * (bunchsize - 1);
+		pn = pointindex;
+		ln = line;
+		while (pn <= pb) {
+			bool status = get_one(fd, pn, ln);
+			if (status && ln == line) {
+				pn += bunchsubsample;
+			}
+			else {
+				pb = pn - bunchsubsample;
+				pa = pb - bunchsubsample * (bunchsize - 1);
+				break;
+			}
+		}
+
+		std::vector<std::size_t> indices = increment((size_t)bunchsize, (size_t)pa, (size_t)bunchsubsample);
+		bunch = cSampleBunch(indices, pointindex);
+		return true;
+	};
+
 	virtual bool get_acsiicolumnfield(const cFieldDefinition& fd, cAsciiColumnField& c) const {
 		glog.errormsg(_SRC_, "get_acsiicolumnfield() not yet implemented\n");
 		return true;
@@ -167,6 +242,59 @@ class cASCIIInputManager : public cInputManager {
 private:
 	cAsciiColumnFile AF;
 
+	//With MemoryMap the data file is read through the mapping and only the field layout comes from AF
+	bool MemoryMap = false;
+	cMappedRecordFile MF;
+	std::string_view CurrentRecord;
+	std::vector<std::string_view> Tokens;
+	std::vector<std::pair<size_t, size_t>> ColumnChars;//start character and width of each fixed width column
+	mutable std::string RecordString;
+	mutable std::vector<std::string> Columns;
+
+	void set_column_chars() {
+		ColumnChars.clear();
+		for (const cAsciiColumnField& f : AF.fields) {
+			for (size_t k = 0; k < f.nbands; k++) {
+				ColumnChars.push_back({ f.startchar + k * f.width, f.width });
+			}
+		}
+	}
+
+	//Text of the zero based column c of the current record, empty if the record is too short
+	std::string_view column_text(const size_t& c) const {
+		if (AF.parsetype == cAsciiColumnFile::ParseType::DELIMITED) {
+			if (c < Tokens.size()) return Tokens[c];
+			return std::string_view();
+		}
+		if (c >= ColumnChars.size()) return std::string_view();
+		const size_t& start = ColumnChars[c].first;
+		if (start >= CurrentRecord.size()) return std::string_view();
+		return CurrentRecord.substr(start, ColumnChars[c].second);
+	}
+
+	template<typename T>
+	bool mapped_read(const cFieldDefinition& fd, std::vector<T>& vec, const size_t n)
+	{
+		size_t c0;
+		if (fd.type == cFieldDefinition::TYPE::VARIABLENAME) {
+			int findex = AF.fieldindexbyname(fd.varname);
+			if (findex < 0) return false;
+			c0 = (size_t)AF.fields[findex].startcol();
+		}
+		else if (fd.type == cFieldDefinition::TYPE::COLUMNNUMBER) {
+			c0 = (size_t)fd.column - 1;
+		}
+		else return false;
+
+		bool status = true;
+		vec.resize(n);
+		for (size_t i = 0; i < n; i++) {
+			if (parse_column_text(column_text(c0 + i), vec[i]) == false) status = false;
+		}
+		fd.apply_flip_and_operator(vec);
+		return status;
+	}
+
 public:
 
 	std::string HeaderFileName;
@@ -243,10 +371,24 @@ public:
 		size_t headerlines = b.getsizetvalue("Headerlines");
 		if (!isdefined(headerlines)) { headerlines = 0; }
 		HeaderLines = headerlines;
+
+		if (b.getvalue("MemoryMap", MemoryMap) == false) {
+			MemoryMap = false;
+		}
+		if (MemoryMap) {
+			if (MF.open(DataFileName) == false) {
+				glog.errormsg(_SRC_, "Could not memory map the Input DataFile %s\n", DataFileName.c_str());
+			}
+			if (AF.parsetype == cAsciiColumnFile::ParseType::FIXEDWIDTH) {
+				set_column_chars();
+			}
+		}
 	}
 
 	bool is_record_valid() {
-		bool status = AF.is_record_valid();
+		bool status;
+		if (MemoryMap) status = CurrentRecord.find_first_not_of(" \t") != std::string_view::npos;
+		else status = AF.is_record_valid();
 		if (status == false) {
 			std::string msg;
 			msg = strprint("Skipping non-valid record at line %zu of Input DataFile %s\n", record(), datafilename().c_str());
@@ -264,81 +406,72 @@ public:
 	bool load_record(const size_t& n)
 	{
 		Record = n;
+		if (MemoryMap) {
+			const size_t line = n + HeaderLines;
+			if (line >= MF.nrecords()) return false;
+			CurrentRecord = MF.record(line);
+			Tokens.clear();
+			return true;
+		}
 		return AF.load_record(n + HeaderLines);
 	}
 
 	bool parse_record() {
+		if (MemoryMap) {
+			if (AF.parsetype == cAsciiColumnFile::ParseType::FIXEDWIDTH) {
+				return CurrentRecord.size() > 1;
+			}
+			Tokens.clear();
+			size_t p = 0;
+			while (true) {
+				p = CurrentRecord.find_first_not_of(" \t,", p);
+				if (p == std::string_view::npos) break;
+				size_t q = CurrentRecord.find_first_of(" \t,", p);
+				if (q == std::string_view::npos) q = CurrentRecord.size();
+				Tokens.push_back(CurrentRecord.substr(p, q - p));
+				p = q;
+			}
+			return Tokens.size() > 1;
+		}
 		size_t n = AF.parse_record();
 		if (n <= 1) return false;
 		return true;
 	}
 
-	template<typename T>
-	bool get_one(const cFieldDefinition& fd, const size_t& pointindex, T& val) {
-		if (load_record(pointindex)) {
-			if (parse_record()) {
-				if (fd.isinitialised()) {
-					if (read(fd, val)) {
-						return true;
-					};
-				}
-				else {
-					return true;
-				}
-			}
-		}
-		return false;
-	}
-
 	bool get_bunch(cSampleBunch& bunch, const cFieldDefinition& fd, const int& pointindex, const int& bunchsize, const int& bunchsubsample)
 	{
-		int line;
-		bool status = get_one(fd, pointindex, line);
-
-		if (status == false) return false;
+		return get_bunch_by_line(bunch, fd, pointindex, bunchsize, bunchsubsample);
+	};
 
-		int pn = pointindex;
-		int ln = line;
+	const std::vector<cAsciiColumnField>& columnfields() const { return AF.fields; }
 
-		int pa = pointindex - bunchsubsample * ((bunchsize - 1) / 2);
-		while (pa < 0) pa += bunchsubsample;
-		pn = pointindex - bunchsubsample;
-		if (pn < pa) pn = pa;
+	//Text of the zero based column c of the parsed current record
+	std::string_view column_string(const size_t& c) const {
+		if (MemoryMap) return column_text(c);
+		const std::vector<std::string>& cols = AF.currentrecord_columns();
+		if (c < cols.size()) return cols[c];
+		return std::string_view();
+	}
 
-		while (pn > pa) {
-			bool status = get_one(fd, pn, ln);
-			if (status && ln == line) {
-				pn -= bunchsubsample;
-			}
-			else {
-				pa = pn + bunchsubsample;
-				break;
-			}
+	const std::string& recordstring() const {
+		if (MemoryMap) {
+			RecordString.assign(CurrentRecord);
+			return RecordString;
 		}
+		return AF.currentrecord_string();
+	}
 
-		int pb = pa + bunchsubsample * (bunchsize - 1);
-		pn = pointindex;
-		ln = line;
-		while (pn <= pb) {
-			bool status = get_one(fd, pn, ln);
-			if (status && ln == line) {
-				pn += bunchsubsample;
-			}
-			else {
-				pb = pn - bunchsubsample;
-				pa = pb - bunchsubsample * (bunchsize - 1);
-				break;
+	const std::vector<std::string>& fields() const {
+		if (MemoryMap) {
+			Columns.clear();
+			const size_t nc = AF.parsetype == cAsciiColumnFile::ParseType::DELIMITED ? Tokens.size() : ColumnChars.size();
+			for (size_t c = 0; c < nc; c++) {
+				Columns.push_back(std::string(column_text(c)));
 			}
+			return Columns;
 		}
-
-		std::vector<std::size_t> indices = increment((size_t)bunchsize, (size_t)pa, (size_t)bunchsubsample);
-		bunch = cSampleBunch(indices, pointindex);
-		return true;
-	};
-
-	const std::string& recordstring() const { return AF.currentrecord_string(); }
-
-	const std::vector<std::string>& fields() const { return AF.currentrecord_columns(); }
+		return AF.currentrecord_columns();
+	}
 
 	bool file_read(const cFieldDefinition& fd, std::vector<char>& vec, const size_t n) { return file_read_impl(fd, vec, n); }
 	bool file_read(const cFieldDefinition& fd, std::vector<int>& vec, const size_t n) { return file_read_impl(fd, vec, n); }
@@ -348,6 +481,7 @@ public:
 	template<typename T>
 	bool file_read_impl(const cFieldDefinition& fd, std::vector<T>& vec, const size_t n)
 	{
+		if (MemoryMap) return mapped_read(fd, vec, n);
 		bool status = AF.getvec_fielddefinition(fd, vec, n);
 		return status;
 	}
@@ -383,12 +517,205 @@ public:
 
 };
 
+//Reads the columnar binary copy of an ASCII data file made by ascii2columnar
+class cColumnarInputManager : public cInputManager {
+
+private:
+	cColumnarFile CF;
+
+	bool locate(const cFieldDefinition& fd, size_t& fi, size_t& band) const {
+		if (fd.type == cFieldDefinition::TYPE::VARIABLENAME) {
+			int findex = CF.fieldindex(fd.varname);
+			if (findex < 0) return false;
+			fi = (size_t)findex;
+			band = 0;
+			return true;
+		}
+		else if (fd.type == cFieldDefinition::TYPE::COLUMNNUMBER) {
+			return CF.locate_column((size_t)fd.column - 1, fi, band);
+		}
+		return false;
+	}
+
+public:
+
+	cColumnarInputManager(const cBlock& b) {
+		cInputManager::initialise(b);
+		initialise(b);
+	}
+
+	~cColumnarInputManager() {	};
+
+	void initialise(const cBlock& b)
+	{
+		glog.logmsg(0, "Opening Input DataFile %s\n", DataFileName.c_str());
+		iotype = IOType::COLUMNAR;
+		if (!exists(DataFileName)) {
+			std::string msg = _SRC_;
+			msg += strprint("\n\tD'Oh! the specified data file (%s) does not exist\n", DataFileName.c_str());
+			throw(std::runtime_error(msg));
+		}
+		if (CF.open(DataFileName) == false) {
+			std::string msg = _SRC_;
+			msg += strprint("\n\tD'Oh! the specified data file (%s) is not a valid columnar data file\n", DataFileName.c_str());
+			throw(std::runtime_error(msg));
+		}
+	}
+
+	bool load_record(const size_t& n)
+	{
+		Record = n;
+		return n < CF.nrecords();
+	}
+
+	bool is_record_valid() {
+		if (CF.valid(Record)) return true;
+		std::string msg = strprint("Skipping non-valid record %zu of Input DataFile %s\n", record(), datafilename().c_str());
+		glog.logmsg(msg);
+		std::cerr << msg;
+		return false;
+	}
+
+	bool get_bunch(cSampleBunch& bunch, const cFieldDefinition& fd, const int& pointindex, const int& bunchsize, const int& bunchsubsample)
+	{
+		return get_bunch_by_line(bunch, fd, pointindex, bunchsize, bunchsubsample);
+	};
+
+	bool file_read(const cFieldDefinition& fd, std::vector<char>& vec, const size_t n) { return file_read_impl(fd, vec, n); }
+	bool file_read(const cFieldDefinition& fd, std::vector<int>& vec, const size_t n) { return file_read_impl(fd, vec, n); }
+	bool file_read(const cFieldDefinition& fd, std::vector<float>& vec, const size_t n) { return file_read_impl(fd, vec, n); }
+	bool file_read(const cFieldDefinition& fd, std::vector<double>& vec, const size_t n) { return file_read_impl(fd, vec, n); }
+
+	//Bands past the end of a field continue into the following fields, as columns do in the ASCII file
+	template<typename T>
+	bool file_read_impl(const cFieldDefinition& fd, std::vector<T>& vec, const size_t n)
+	{
+		vec.resize(n);
+		size_t fi, band;
+		if (locate(fd, fi, band) == false) return false;
+		bool status = true;
+		for (size_t i = 0; i < n; i++) {
+			while (fi < CF.fields().size() && band >= CF.fields()[fi].nbands) {
+				band -= CF.fields()[fi].nbands;
+				fi++;
+			}
+			if (fi >= CF.fields().size()) {
+				vec[i] = undefinedvalue<T>();
+				status = false;
+				continue;
+			}
+			if (CF.get(fi, Record, band, vec[i]) == false) status = false;
+			band++;
+		}
+		return status;
+	}
+
+	bool get_acsiicolumnfield(const cFieldDefinition& fd, cAsciiColumnField& c) const {
+		size_t fi, band;
+		if (locate(fd, fi, band) == false) return false;
+		const cColumnarField& f = CF.fields()[fi];
+		c.name = f.name;
+		c.nbands = f.nbands;
+		c.fmtchar = f.fmtchar;
+		c.width = f.width;
+		c.decimals = f.decimals;
+		c.atts.add(cAsciiColumnField::UNITS, f.units);
+		c.atts.add(cAsciiColumnField::DESC, f.description);
+		return true;
+	}
+
+	bool set_variant_type(const cFieldDefinition& fd, cVrnt& vnt) const {
+		cAsciiColumnField c;
+		bool status = get_acsiicolumnfield(fd, c);
+		if (status) {
+			c.set_variant_type(vnt);
+			return true;
+		}
+		else {
+			glog.errormsg(_SRC_, "Could not find field %s\n", fd.varname.c_str());
+			return false;
+		}
+	}
+};
+
 #if defined HAVE_NETCDF
 class cNetCDFInputManager : public cInputManager {
 
 private:
 	cGeophysicsNcFile NC;
 
+	//Records of one variable read with a single hyperslab read
+	class cPrefetchBlock {
+	public:
+		bool prefetchable = false;
+		bool transposed = false;//stored as [band][point] rather than [point][band]
+		size_t blocksize = 0;
+		size_t nbands = 1;
+		size_t start = 0;
+		size_t count = 0;
+		std::vector<double> data;
+	};
+
+	size_t PrefetchRecords = 4096;
+	std::map<std::string, cPrefetchBlock> Blocks;
+
+	//Only sample variables indexed by point are prefetched, line variables and anything else are read directly.
+	//Blocks are whole multiples of the point chunk size and start on a chunk boundary so each chunk is decompressed once.
+	cPrefetchBlock& prefetch_block(const std::string& varname) {
+		auto it = Blocks.find(varname);
+		if (it != Blocks.end()) return it->second;
+
+		cPrefetchBlock& b = Blocks[varname];
+		if (PrefetchRecords == 0 || NC.hasVar(varname) == false) return b;
+		netCDF::NcVar var = NC.getVar(varname);
+		if (NC.isSampleVar(var) == false) return b;
+
+		const size_t ndims = (size_t)var.getDimCount();
+		const size_t npoints = NC.ntotalsamples();
+		size_t pointdim = 0;
+		if (ndims == 1 && var.getDim(0).getSize() == npoints) {
+			b.nbands = 1;
+		}
+		else if (ndims == 2 && var.getDim(0).getSize() == npoints) {
+			b.nbands = var.getDim(1).getSize();
+		}
+		else if (ndims == 2 && var.getDim(1).getSize() == npoints) {
+			b.nbands = var.getDim(0).getSize();
+			b.transposed = true;
+			pointdim = 1;
+		}
+		else return b;
+
+		size_t chunk = 1;
+		netCDF::NcVar::ChunkMode mode;
+		std::vector<size_t> chunksizes;
+		var.getChunkingParameters(mode, chunksizes);
+		if (mode == netCDF::NcVar::nc_CHUNKED && pointdim < chunksizes.size() && chunksizes[pointdim] > 0) {
+			chunk = chunksizes[pointdim];
+		}
+		b.blocksize = chunk * ((PrefetchRecords + chunk - 1) / chunk);
+		b.prefetchable = true;
+		return b;
+	}
+
+	bool fill_block(const std::string& varname, cPrefetchBlock& b) {
+		const size_t npoints = NC.ntotalsamples();
+		b.start = (Record / b.blocksize) * b.blocksize;
+		b.count = std::min(b.blocksize, npoints - b.start);
+		b.data.resize(b.count * b.nbands);
+		netCDF::NcVar var = NC.getVar(varname);
+		if (var.getDimCount() == 1) {
+			var.getVar({ b.start }, { b.count }, b.data.data());
+		}
+		else if (b.transposed) {
+			var.getVar({ 0, b.start }, { b.nbands, b.count }, b.data.data());
+		}
+		else {
+			var.getVar({ b.start, 0 }, { b.count, b.nbands }, b.data.data());
+		}
+		return true;
+	}
+
 public:
 
 	cNetCDFInputManager(const cBlock& b) {
@@ -403,6 +730,9 @@ public:
 		glog.logmsg(0, "Opening Input DataFile %s\n", DataFileName.c_str());
 		iotype = IOType::NETCDF;
 		NC.open(DataFileName, netCDF::NcFile::FileMode::read);
+		if (b.getvalue("PrefetchRecords", PrefetchRecords) == false) {
+			PrefetchRecords = 4096;
+		}
 	}
 
 	bool load_record(const size_t& n)
@@ -422,7 +752,22 @@ public:
 	template<typename T>
 	bool file_read_impl(const cFieldDefinition& fd, std::vector<T>& v, const size_t n)
 	{
-		NC.getDataByPointIndex(fd.varname, Record, v);
+		cPrefetchBlock& b = prefetch_block(fd.varname);
+		if (b.prefetchable == false || Record >= NC.ntotalsamples()) {
+			NC.getDataByPointIndex(fd.varname, Record, v);
+			return true;
+		}
+
+		if (b.count == 0 || Record < b.start || Record >= b.start + b.count) {
+			fill_block(fd.varname, b);
+		}
+
+		const size_t k = Record - b.start;
+		v.resize(b.nbands);
+		for (size_t i = 0; i < b.nbands; i++) {
+			const double& d = b.transposed ? b.data[i * b.count + k] : b.data[k * b.nbands + i];
+			v[i] = (T)d;
+		}
 		return true;
 	}
 };
@@ -194,6 +194,7 @@ private:
 	double LowerFractionalWidth;
 	double UpperFractionalWidth;
 	size_t number_integrand_calls;
+	size_t integrand_call_count = 0;//never reset, used for profiling
 	cdouble trapezoid_result[3];
 	cdouble integrand_result[3];
 
@@ -212,6 +213,8 @@ public:
 
 	~cLEM(){};
 
+	size_t total_integrand_calls() const { return integrand_call_count; }
+
 	void initialise()
 	{
 		xaxis = cVec(1.0, 0.0, 0.0);
@@ -927,6 +930,7 @@ public:
 	{
 		AbscissaNode& A = Frequency[fi].Abscissa[ai];
 		number_integrand_calls++;
+		integrand_call_count++;
 
 		double loopfactor = 1.0;
 		if (ModellingLoopRadius > 0.0){
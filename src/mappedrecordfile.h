@@ -0,0 +1,285 @@
+/*
+This source code file is licensed under the GNU GPL Version 2.0 Licence by the following copyright holder:
+Crown Copyright Commonwealth of Australia (Geoscience Australia) 2015.
+The GNU GPL 2.0 licence is available at: http://www.gnu.org/licenses/gpl-2.0.html. If you require a paper copy of the GNU GPL 2.0 Licence, please write to Free Software Foundation, Inc. 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+Author: Ross C. Brodie, Geoscience Australia.
+*/
+
+#ifndef _mappedrecordfile_H
+#define _mappedrecordfile_H
+
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+
+#if defined _WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+#include "logger.h"
+#include "general_utils.h"
+
+//Converts the text of one column, stopping at the end of the column rather than running into the next one
+template<typename T>
+bool parse_column_text(std::string_view s, T& v) {
+	const size_t a = s.find_first_not_of(" \t");
+	if (a == std::string_view::npos) {
+		v = undefinedvalue<T>();
+		return false;
+	}
+	s = s.substr(a, s.find_last_not_of(" \t") + 1 - a);
+
+	if constexpr (std::is_same<T, char>::value) {
+		v = s[0];
+		return true;
+	}
+	else {
+		char buf[64];
+		const size_t len = std::min(s.size(), sizeof(buf) - 1);
+		std::memcpy(buf, s.data(), len);
+		buf[len] = 0;
+		char* end = nullptr;
+		if constexpr (std::is_integral<T>::value) {
+			v = (T)std::strtoll(buf, &end, 10);
+		}
+		else {
+			v = (T)std::strtod(buf, &end);
+		}
+		return end != buf;
+	}
+}
+
+//Read only memory map of a whole file
+class cMemoryMappedFile {
+
+	const char* Data = nullptr;
+	size_t Size = 0;
+#if defined _WIN32
+	HANDLE File = INVALID_HANDLE_VALUE;
+	HANDLE Mapping = NULL;
+#endif
+
+public:
+
+	cMemoryMappedFile() {};
+
+	cMemoryMappedFile(const cMemoryMappedFile&) = delete;
+	cMemoryMappedFile& operator=(const cMemoryMappedFile&) = delete;
+
+	~cMemoryMappedFile() {
+		close();
+	};
+
+	bool open(const std::string& path) {
+		close();
+#if defined _WIN32
+		File = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (File == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER sz;
+		if (GetFileSizeEx(File, &sz) == 0) { close(); return false; }
+		Size = (size_t)sz.QuadPart;
+		if (Size == 0) return true;
+		Mapping = CreateFileMappingA(File, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (Mapping == NULL) { close(); return false; }
+		Data = (const char*)MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+		if (Data == nullptr) { close(); return false; }
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0) { ::close(fd); return false; }
+		Size = (size_t)st.st_size;
+		if (Size > 0) {
+			void* p = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p == MAP_FAILED) { ::close(fd); Size = 0; return false; }
+			Data = (const char*)p;
+		}
+		//The mapping stays valid after the descriptor is closed
+		::close(fd);
+#endif
+		return true;
+	}
+
+	void close() {
+#if defined _WIN32
+		if (Data) UnmapViewOfFile(Data);
+		if (Mapping != NULL) CloseHandle(Mapping);
+		if (File != INVALID_HANDLE_VALUE) CloseHandle(File);
+		Mapping = NULL;
+		File = INVALID_HANDLE_VALUE;
+#else
+		if (Data) munmap((void*)Data, Size);
+#endif
+		Data = nullptr;
+		Size = 0;
+	}
+
+	const char* data() const { return Data; }
+
+	const size_t& size() const { return Size; }
+};
+
+//Line oriented access to a memory mapped ASCII file.
+//The byte offset of every line is found once and kept in a sidecar index file (datafile.idx)
+//so later runs, and every process of a parallel run, can go straight to any record.
+class cMappedRecordFile {
+
+	struct cIndexHeader {
+		char magic[8];
+		uint64_t version;
+		uint64_t filesize;
+		int64_t mtime;
+		uint64_t nrecords;
+	};
+
+	static constexpr char Magic[8] = { 'G','A','A','E','M','I','D','X' };
+	static constexpr uint64_t Version = 1;
+
+	std::string DataFile;
+	std::string IndexFile;
+	cMemoryMappedFile Map;
+	cMemoryMappedFile IndexMap;
+	std::vector<uint64_t> Built;
+	const uint64_t* Offsets = nullptr;//nrecords+1 line starts, the last being the file size
+	size_t NRecords = 0;
+
+	static int64_t modification_time(const std::string& path) {
+		std::error_code ec;
+		auto t = std::filesystem::last_write_time(path, ec);
+		if (ec) return 0;
+		return (int64_t)t.time_since_epoch().count();
+	}
+
+	cIndexHeader make_header() const {
+		cIndexHeader h;
+		std::memcpy(h.magic, Magic, sizeof(Magic));
+		h.version = Version;
+		h.filesize = (uint64_t)Map.size();
+		h.mtime = modification_time(DataFile);
+		h.nrecords = (uint64_t)NRecords;
+		return h;
+	}
+
+	bool load_index() {
+		if (std::filesystem::exists(IndexFile) == false) return false;
+		if (IndexMap.open(IndexFile) == false) return false;
+		if (IndexMap.size() < sizeof(cIndexHeader)) return false;
+
+		cIndexHeader h;
+		std::memcpy(&h, IndexMap.data(), sizeof(cIndexHeader));
+		const cIndexHeader e = make_header();
+		if (std::memcmp(h.magic, Magic, sizeof(Magic)) != 0) return false;
+		if (h.version != Version) return false;
+		if (h.filesize != e.filesize || h.mtime != e.mtime) return false;//stale
+		if (IndexMap.size() != sizeof(cIndexHeader) + (h.nrecords + 1) * sizeof(uint64_t)) return false;
+
+		NRecords = (size_t)h.nrecords;
+		Offsets = (const uint64_t*)(IndexMap.data() + sizeof(cIndexHeader));
+		return true;
+	}
+
+	void build_index() {
+		IndexMap.close();
+		Built.clear();
+		const char* p = Map.data();
+		const char* end = p + Map.size();
+		while (p < end) {
+			Built.push_back((uint64_t)(p - Map.data()));
+			const char* nl = (const char*)std::memchr(p, '\n', (size_t)(end - p));
+			p = nl ? nl + 1 : end;
+		}
+		NRecords = Built.size();
+		Built.push_back((uint64_t)Map.size());
+		Offsets = Built.data();
+	}
+
+	//Host, process and time, so processes on any node of a parallel run pick different temporary names
+	static std::string unique_suffix() {
+		char host[256] = { 0 };
+#if defined _WIN32
+		DWORD n = (DWORD)sizeof(host);
+		GetComputerNameA(host, &n);
+		const unsigned long pid = (unsigned long)GetCurrentProcessId();
+#else
+		gethostname(host, sizeof(host) - 1);
+		const unsigned long pid = (unsigned long)getpid();
+#endif
+		return std::string(host) + "." + std::to_string(pid) + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+	}
+
+	//Written to a temporary file then renamed so processes building the index at the same time cannot see a partial file
+	bool save_index() const {
+		const std::string tmp = IndexFile + "." + unique_suffix();
+		{
+			std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+			if (!ofs) return false;
+			const cIndexHeader h = make_header();
+			ofs.write((const char*)&h, sizeof(h));
+			ofs.write((const char*)Offsets, (std::streamsize)((NRecords + 1) * sizeof(uint64_t)));
+			if (!ofs) {
+				ofs.close();
+				std::error_code ec;
+				std::filesystem::remove(tmp, ec);
+				return false;
+			}
+		}
+		std::error_code ec;
+		std::filesystem::rename(tmp, IndexFile, ec);
+		if (ec) {
+			std::filesystem::remove(tmp, ec);
+			return false;
+		}
+		return true;
+	}
+
+public:
+
+	cMappedRecordFile() {};
+
+	bool open(const std::string& datafile) {
+		DataFile = datafile;
+		IndexFile = datafile + ".idx";
+		if (Map.open(DataFile) == false) return false;
+
+		if (load_index()) {
+			glog.logmsg(0, "Loaded record index %s (%zu records)\n", IndexFile.c_str(), NRecords);
+			return true;
+		}
+
+		build_index();
+		if (save_index()) {
+			glog.logmsg(0, "Wrote record index %s (%zu records)\n", IndexFile.c_str(), NRecords);
+		}
+		else {
+			glog.logmsg(0, "Could not write record index %s, the index is only kept in memory\n", IndexFile.c_str());
+		}
+		return true;
+	}
+
+	const size_t& nrecords() const { return NRecords; }
+
+	//The line without its terminating newline or carriage return, empty beyond the last record
+	std::string_view record(const size_t& i) const {
+		if (i >= NRecords) return std::string_view();
+		const char* b = Map.data() + Offsets[i];
+		const char* e = Map.data() + Offsets[i + 1];
+		while (e > b && (e[-1] == '\n' || e[-1] == '\r')) e--;
+		return std::string_view(b, (size_t)(e - b));
+	}
+};
+
+#endif
@@ -12,8 +12,14 @@ Author: Ross C. Brodie, Geoscience Australia.
 #include <list>
 #include <iterator>
 #include <optional>
+#include <cstdint>
+#include <limits>
+#include <cstdio>
+#include <type_traits>
+#include <filesystem>
 #include "asciicolumnfile.h"
 #include "fielddefinition.h"
+#include "asyncblockwriter.h"
 
 
 #ifdef ENABLE_MPI
@@ -40,6 +46,22 @@ class cNetCDFOutputManager;
 
 class cOutputManager;
 
+#if defined HAVE_NETCDF
+//Values of a sample variable for a block of points that are written to the file together
+class cNcWriteBlock {
+public:
+	bool checked = false;
+	bool bufferable = false;
+	bool transposed = false;//stored in the file as [band][point] rather than [point][band]
+	size_t blocksize = 0;
+	size_t nbands = 1;
+	size_t start = 0;
+	bool empty = true;
+	std::vector<double> data;//[point][band]
+	std::vector<char> written;
+};
+#endif
+
 class cOutputField {
 	
 	public:		
@@ -55,6 +77,7 @@ class cOutputField {
 		//Netcdf
 		#ifdef HAVE_NETCDF
 		std::shared_ptr<cGeophysicsVar> var;		
+		cNcWriteBlock block;
 		nc_type nctype() {
 			if (btype == binarystoragetype::FLOAT) return NC_FLOAT;
 			else if (btype == binarystoragetype::DOUBLE) return NC_DOUBLE;
@@ -141,8 +164,25 @@ public:
 protected:		
 	std::string DataFileName;	
 	IOType iotype = IOType::NONE;
+	bool Resume = false;
+	int64_t ResumeOffset = -1;
 	using spcOutputField = std::shared_ptr<cOutputField>;
 	std::list<spcOutputField> flist;
+	std::vector<spcOutputField> Schema;//Fields in the order they are written for each point, frozen after the first point
+	size_t SchemaCursor = 0;
+
+	void freeze_schema() {
+		Schema.assign(flist.begin(), flist.end());
+	}
+
+	//After the first point the fields come in the same order so are found by position rather than by name
+	spcOutputField schema_field(const std::string& name) {
+		const size_t i = SchemaCursor++;
+		if (i < Schema.size() && Schema[i]->name == name) {
+			return Schema[i];
+		}
+		return getfield(name);
+	}
 
 public:
 	
@@ -170,7 +210,23 @@ public:
 	
 	const std::string& datafilename() { return DataFileName; }
 
+	//Must be called before opendatafile() to continue an existing output file
+	void set_resume(const int64_t& offset) {
+		Resume = true;
+		ResumeOffset = offset;
+	}
+
+	//Current size of the output data file, or -1 where records are not appended
+	virtual int64_t tell() { return -1; }
+
 	virtual bool opendatafile(const std::string& srcfile, const size_t& subsample) = 0;
+
+	//Complete any pending writes
+	virtual void closedatafile() {};
+
+	//Points whose output has been ended, and how many of those are known to be in the file
+	virtual size_t points_ended() const { return 0; }
+	virtual size_t durable_points() const { return std::numeric_limits<size_t>::max(); }
 	
 	spcOutputField getfield(const std::string& name) {
 		spcOutputField f;
@@ -222,7 +278,7 @@ public:
 			};
 		}
 		else {
-			f = getfield(_name);
+			f = schema_field(_name);
 		}
 		write(vals, f, pointindex);
 		return true;
@@ -281,19 +337,47 @@ class cASCIIOutputManager : public cOutputManager {
 
 private:
 	std::ofstream filestream;
-	std::ostringstream buffer;	
-	void set_formatflags(const spcOutputField& of) {
-		if (of->acol.fmtchar == 'e' || of->acol.fmtchar == 'E') {
-			buffer << std::scientific;
-		}
-		else {
-			buffer << std::fixed;
-		}
-	}
+	std::string buffer;
+	cAsyncBlockWriter Writer;
 	bool SaveDFNHeader = true;
 	bool SaveCSVHeader = true;
 	bool SaveHDRHeader = true;
 	bool SaveI3Header  = true;
+	bool AsyncWrite    = true;
+
+	template <typename... Args>
+	void append_formatted(const char* fmt, Args... args) {
+		char s[64];
+		const int n = std::snprintf(s, sizeof(s), fmt, args...);
+		if (n < (int)sizeof(s)) {
+			buffer.append(s, (size_t)n);
+		}
+		else {
+			std::string l((size_t)n + 1, ' ');
+			std::snprintf(&l[0], l.size(), fmt, args...);
+			buffer.append(l.data(), (size_t)n);
+		}
+	}
+
+	//Same text as the previous stream formatting (std::fixed or std::scientific, setw, setprecision)
+	template <typename T>
+	void format_value(const T& val, const cAsciiColumnField& c) {
+		const int w = (int)c.width;
+		const int d = (int)c.decimals;
+		if constexpr (std::is_floating_point<T>::value) {
+			if (c.fmtchar == 'e' || c.fmtchar == 'E') append_formatted("%*.*e", w, d, (double)val);
+			else append_formatted("%*.*f", w, d, (double)val);
+		}
+		else if constexpr (std::is_same<T, char>::value) {
+			append_formatted("%*c", w, val);
+		}
+		else if constexpr (std::is_signed<T>::value) {
+			append_formatted("%*lld", w, (long long)val);
+		}
+		else {
+			append_formatted("%*llu", w, (unsigned long long)val);
+		}
+	}
 
 public:
 
@@ -302,7 +386,9 @@ public:
 		initialise(b);
 	}
 
-	~cASCIIOutputManager() {	};
+	~cASCIIOutputManager() {
+		closedatafile();
+	};
 
 	void initialise(const cBlock& b)
 	{
@@ -322,13 +408,40 @@ public:
 		if (b.getvalue("SaveI3Header", status)) {
 			SaveHDRHeader = status;
 		};
+
+		if (b.getvalue("AsyncWrite", status)) {
+			AsyncWrite = status;
+		};
 	}
 
 	bool opendatafile(const std::string& srcfile, const size_t& subsample) {
-		glog.logmsg(0, "Opening Output ASCII DataFile %s\n", DataFileName.c_str());
-		filestream.open(DataFileName, std::ofstream::out);
+		if (Resume && std::filesystem::exists(DataFileName)) {
+			//Discard anything written after the last journaled record and continue from there
+			const std::uintmax_t n = ResumeOffset > 0 ? (std::uintmax_t)ResumeOffset : 0;
+			glog.logmsg(0, "Resuming Output ASCII DataFile %s at byte %ju\n", DataFileName.c_str(), n);
+			std::filesystem::resize_file(DataFileName, n);
+			filestream.open(DataFileName, std::ofstream::in | std::ofstream::out);
+			filestream.seekp(0, std::ios::end);
+		}
+		else {
+			glog.logmsg(0, "Opening Output ASCII DataFile %s\n", DataFileName.c_str());
+			filestream.open(DataFileName, std::ofstream::out);
+		}
+		if (filestream.is_open() && AsyncWrite) {
+			Writer.start(filestream, (int64_t)filestream.tellp());
+		}
 		return filestream.is_open();
 	};
+
+	void closedatafile() {
+		Writer.stop();
+		if (filestream.is_open()) filestream.close();
+	}
+
+	int64_t tell() {
+		if (Writer.running()) return Writer.offset();
+		return (int64_t)filestream.tellp();
+	}
 	
 	spcOutputField add_smartptr(cOutputField& f){
 		f.acol.fileorder = flist.size();
@@ -388,12 +501,21 @@ public:
 	}
 
 	void begin_point_output() {		
-		buffer.str(std::string());	//empty buffer
+		buffer.clear();
+		SchemaCursor = 0;
 	};
 
 	void end_point_output() {
-		buffer << std::endl; //Carriage return		
-		filestream << buffer.str() << std::flush; // Write to file
+		buffer += '\n';
+		if (Writer.running()) {
+			Writer.append(buffer);
+			if (Writer.failed()) {
+				glog.errormsg(_SRC_, "Error writing to output file %s\n", DataFileName.c_str());
+			}
+		}
+		else {
+			filestream << buffer << std::flush;
+		}
 	};
 
 	bool end_first_record(){
@@ -401,6 +523,7 @@ public:
 			write_headers();
 		}
 		firstpointwritten = true;
+		freeze_schema();
 		return true;
 	}
 
@@ -471,26 +594,21 @@ public:
 
 	template <typename T> 
 	bool write_scalar(const T& val, const spcOutputField& f, const int& pointindex) {		
-		set_formatflags(f);				
-		const size_t& w = f->acol.width;
-		const size_t& d = f->acol.decimals;
-		buffer << std::setw(w) << std::setprecision(d) << val;
+		format_value(val, f->acol);
 		return true;
 	}
 
 	template <typename T>
 	bool write_vector(const std::vector<T>& vals, const spcOutputField& f, const int& pointindex) {
-		set_formatflags(f);
-		const size_t& w = f->acol.width;
-		const size_t& d = f->acol.decimals;				
+		const cAsciiColumnField& c = f->acol;
 		for (size_t i = 0; i < vals.size(); i++) {			
-			buffer << std::setw(w) << std::setprecision(d)  << vals[i];
+			format_value(vals[i], c);
 		}				
 		return true;
 	}
 	
 	bool writevrnt(const int& pointindex, const cVrnt& vrnt, const cAsciiColumnField& c){
-		spcOutputField sp = getfield(c.name);		
+		spcOutputField sp = firstpointwritten ? schema_field(c.name) : getfield(c.name);
 		if (!sp) {			
 			sp = addfield(c);
 		}				
@@ -577,6 +695,150 @@ class cNetCDFOutputManager : public cOutputManager {
 
 private:	
 	cGeophysicsNcFile NC;
+	size_t FlushRecords = 4096;
+	size_t ChunkRecords = 0;
+	int DeflateLevel = 0;
+	size_t PointsEnded = 0;
+	size_t DurablePoints = 0;
+
+	//With LazyOutput each process creates its own file on first use, holding only the
+	//index/line structure and the IncludeInputVariables, and records where the rest can be found
+	bool LazyOutput = false;
+	bool Opened = false;
+	std::vector<std::string> IncludeInputVariables;
+	std::string SourceFile;
+	size_t SourceSubsample = 1;
+
+	void create_lazy() {
+		cGeophysicsNcFile inncfile(SourceFile, NcFile::FileMode::read);
+		std::vector<std::string> include_varnames;
+		std::vector<std::string> exclude_varnames;
+		for (const std::string& v : IncludeInputVariables) {
+			if (inncfile.hasVar(v)) include_varnames.push_back(v);
+			else glog.logmsg(0, "Input variable %s is not in %s so is not copied\n", v.c_str(), SourceFile.c_str());
+		}
+		glog.logmsg(0, "Creating Output NetCDF DataFile %s with %zu input variables\n", DataFileName.c_str(), include_varnames.size());
+		cGeophysicsNcFile outncfile(datafilename(), NcFile::FileMode::replace);
+		outncfile.subsample(SourceFile, SourceSubsample, include_varnames, exclude_varnames);
+		outncfile.putAtt("source_file", SourceFile);
+		outncfile.putAtt("source_subsample", std::to_string(SourceSubsample));
+	}
+
+	void ensure_open() {
+		if (Opened) return;
+		if (LazyOutput && (Resume == false || std::filesystem::exists(datafilename()) == false)) {
+			create_lazy();
+		}
+		glog.logmsg(0, "Opening Output NetCDF DataFile %s\n", DataFileName.c_str());
+		NC.open(datafilename(), NcFile::FileMode::write);
+		Opened = true;
+	}
+
+	//Sample variables indexed by point are buffered a block of points at a time.
+	//Blocks are whole multiples of the point chunk size and start on a chunk boundary,
+	//so a flush writes whole chunks rather than reading, modifying and rewriting them for every record.
+	void check_block(cOutputField& of) {
+		cNcWriteBlock& b = of.block;
+		if (b.checked) return;
+		b.checked = true;
+		if (FlushRecords == 0 || !of.var) return;
+		if (NC.isSampleVar(*of.var) == false) return;
+
+		const size_t ndims = (size_t)of.var->getDimCount();
+		const size_t npoints = NC.ntotalsamples();
+		size_t pointdim = 0;
+		if (ndims == 1 && of.var->getDim(0).getSize() == npoints) {
+			b.nbands = 1;
+		}
+		else if (ndims == 2 && of.var->getDim(0).getSize() == npoints) {
+			b.nbands = of.var->getDim(1).getSize();
+		}
+		else if (ndims == 2 && of.var->getDim(1).getSize() == npoints) {
+			b.nbands = of.var->getDim(0).getSize();
+			b.transposed = true;
+			pointdim = 1;
+		}
+		else return;
+
+		size_t chunk = 1;
+		netCDF::NcVar::ChunkMode mode;
+		std::vector<size_t> chunksizes;
+		of.var->getChunkingParameters(mode, chunksizes);
+		if (mode == netCDF::NcVar::nc_CHUNKED && pointdim < chunksizes.size() && chunksizes[pointdim] > 0) {
+			chunk = chunksizes[pointdim];
+		}
+		b.blocksize = chunk * ((FlushRecords + chunk - 1) / chunk);
+		b.bufferable = true;
+	}
+
+	template<typename T>
+	bool buffer(const spcOutputField& of, const int& pointindex, const T* vals, const size_t& n) {
+		cNcWriteBlock& b = of->block;
+		check_block(*of);
+		if (b.bufferable == false || n != b.nbands || pointindex < 0) return false;
+
+		const size_t p = (size_t)pointindex;
+		if (b.empty == false && (p < b.start || p >= b.start + b.blocksize)) {
+			flush_all();
+		}
+		if (b.empty) {
+			b.start = (p / b.blocksize) * b.blocksize;
+			b.data.assign(b.blocksize * b.nbands, 0.0);
+			b.written.assign(b.blocksize, 0);
+			b.empty = false;
+		}
+
+		const size_t k = p - b.start;
+		for (size_t i = 0; i < n; i++) {
+			b.data[k * b.nbands + i] = (double)vals[i];
+		}
+		b.written[k] = 1;
+		return true;
+	}
+
+	//Only points written by this process are put, in contiguous runs, so other processes' points are not overwritten
+	void flush(cOutputField& of) {
+		cNcWriteBlock& b = of.block;
+		if (b.empty) return;
+		const size_t npoints = NC.ntotalsamples();
+		const size_t end = std::min(b.blocksize, npoints - b.start);
+		std::vector<double> t;
+		size_t i = 0;
+		while (i < end) {
+			if (b.written[i] == 0) { i++; continue; }
+			size_t j = i;
+			while (j < end && b.written[j]) j++;
+			const size_t count = j - i;
+			const double* run = b.data.data() + i * b.nbands;
+			if (of.var->getDimCount() == 1) {
+				of.var->putVar({ b.start + i }, { count }, run);
+			}
+			else if (b.transposed) {
+				t.resize(count * b.nbands);
+				for (size_t k = 0; k < count; k++) {
+					for (size_t bi = 0; bi < b.nbands; bi++) {
+						t[bi * count + k] = run[k * b.nbands + bi];
+					}
+				}
+				of.var->putVar({ 0, b.start + i }, { b.nbands, count }, t.data());
+			}
+			else {
+				of.var->putVar({ b.start + i, 0 }, { count, b.nbands }, run);
+			}
+			i = j;
+		}
+		b.empty = true;
+	}
+
+	//All fields are flushed together so that every point ended so far is then complete in the file.
+	//putVar() may leave the data in the library's chunk cache, so the file is synced before the points count as durable.
+	void flush_all() {
+		for (auto& f : flist) {
+			flush(*f);
+		}
+		NC.sync();
+		DurablePoints = PointsEnded;
+	}
 
 public:
 
@@ -585,15 +847,51 @@ public:
 		initialise(b);
 	}
 
-	~cNetCDFOutputManager() {	};
+	~cNetCDFOutputManager() {
+		closedatafile();
+	};
 
 	void initialise(const cBlock& b)
 	{						
 		glog.logmsg(0, "Opening Output DataFile %s\n", DataFileName.c_str());		
 		iotype = IOType::NETCDF;		
+		if (b.getvalue("FlushRecords", FlushRecords) == false) {
+			FlushRecords = 4096;
+		}
+		if (b.getvalue("ChunkRecords", ChunkRecords) == false) {
+			ChunkRecords = 0;
+		}
+		if (b.getvalue("DeflateLevel", DeflateLevel) == false) {
+			DeflateLevel = 0;
+		}
+		if (b.getvalue("LazyOutput", LazyOutput) == false) {
+			LazyOutput = false;
+		}
+		std::string s;
+		if (b.getvalue("IncludeInputVariables", s)) {
+			IncludeInputVariables = tokenize(s);
+		}
+		else {
+			IncludeInputVariables = { "line", "flight", "fiducial", "longitude", "latitude", "easting", "northing" };
+		}
 	}
 
+	void closedatafile() {
+		if (Opened) flush_all();
+	}
+
+	size_t points_ended() const { return PointsEnded; }
+
+	size_t durable_points() const { return DurablePoints; }
+
 	bool opendatafile(const std::string& srcfile, const size_t& subsample) {		
+		SourceFile = srcfile;
+		SourceSubsample = subsample;
+		if (LazyOutput) {
+			//Nothing to wait for, the file is created when the first field is added
+			return true;
+		}
+
 		//std::vector<std::string> include_varnames = { "proj_client", "flight", "flight_index", "longitude", "latitude", "emz_nonhprg" };
 		//std::vector<std::string> exclude_varnames = { "easting", "northing" };
 		std::vector<std::string> include_varnames;
@@ -604,7 +902,10 @@ public:
 #ifdef ENABLE_MPI
 		rank = cMpiEnv::world_rank();
 #endif
-		if (rank == 0){
+		if (Resume && std::filesystem::exists(datafilename())) {
+			glog.logmsg(0, "Resuming Output NetCDF DataFile %s\n", DataFileName.c_str());
+		}
+		else if (rank == 0){
 			glog.logmsg(0, "Creating Output NetCDF DataFile %s\n", DataFileName.c_str());
 			cGeophysicsNcFile inncfile(srcfile, NcFile::FileMode::read);			
 			cGeophysicsNcFile outncfile(datafilename(),NcFile::FileMode::replace);
@@ -615,8 +916,7 @@ public:
 		cMpiEnv::world_barrier();
 #endif
 
-		glog.logmsg(0, "Opening Output NetCDF DataFile %s\n", DataFileName.c_str());
-		NC.open(datafilename(), NcFile::FileMode::write);
+		ensure_open();
 		return true;
 	};
 
@@ -669,15 +969,26 @@ public:
 
 	void begin_point_output() { };
 
-	void end_point_output() { };
+	void end_point_output() {
+		PointsEnded++;
+	};
 
 	bool addvar(cOutputField& of) {		
+		ensure_open();
 		if (NC.hasVar(of.name) == false) {
 			NcDim dim;
 			if (of.ncdimname.size()) {
 				dim = NC.addDim(of.ncdimname, of.bands);
 			}
 			of.var = std::make_shared<cSampleVar>(NC.addSampleVar(of.name, of.nctype(), dim));
+			if (ChunkRecords > 0) {
+				std::vector<size_t> chunks = { ChunkRecords };
+				if (of.ncdimname.size()) chunks.push_back(of.bands);
+				of.var->setChunking(netCDF::NcVar::nc_CHUNKED, chunks);
+			}
+			if (DeflateLevel > 0) {
+				of.var->setCompression(true, true, DeflateLevel);
+			}
 			
 			for (const auto& [key, value] : of.atts) {				
 				of.var->add_attribute(key,value);
@@ -699,32 +1010,40 @@ public:
 	
 	template <typename T>
 	bool write(spcOutputField of, const int& pointindex, const T& val) {
-		return of->var->putRecord(pointindex, val);
+		return write(val, of, pointindex);
 	}
 
 	virtual bool write(const int& val, const spcOutputField& of, const int& pointindex) {
+		if (buffer(of, pointindex, &val, 1)) return true;
 		return of->var->putRecord(pointindex, val);		
 	}
 	virtual bool write(const size_t& val, const spcOutputField& of, const int& pointindex) {
+		if (buffer(of, pointindex, &val, 1)) return true;
 		return of->var->putRecord(pointindex, val);
 	}
 	virtual bool write(const float& val, const spcOutputField& of, const int& pointindex) {
+		if (buffer(of, pointindex, &val, 1)) return true;
 		return of->var->putRecord(pointindex, val);
 	}
 	virtual bool write(const double& val, const spcOutputField& of, const int& pointindex) {
+		if (buffer(of, pointindex, &val, 1)) return true;
 		return of->var->putRecord(pointindex, val);
 	}
 
 	virtual bool write(const std::vector<int>& vals, const spcOutputField& of, const int& pointindex) {
+		if (buffer(of, pointindex, vals.data(), vals.size())) return true;
 		return of->var->putRecord(pointindex, vals);		
 	}
 	virtual bool write(const std::vector<size_t>& vals, const spcOutputField& of, const int& pointindex) {
+		if (buffer(of, pointindex, vals.data(), vals.size())) return true;
 		return of->var->putRecord(pointindex, vals);
 	}
 	virtual bool write(const std::vector<float>& vals, const spcOutputField& of, const int& pointindex) {
+		if (buffer(of, pointindex, vals.data(), vals.size())) return true;
 		return of->var->putRecord(pointindex, vals);
 	}
 	virtual bool write(const std::vector<double>& vals, const spcOutputField& of, const int& pointindex) {
+		if (buffer(of, pointindex, vals.data(), vals.size())) return true;
 		return of->var->putRecord(pointindex, vals);		
 	}	
 };
@@ -0,0 +1,162 @@
+/*
+This source code file is licensed under the GNU GPL Version 2.0 Licence by the following copyright holder:
+Crown Copyright Commonwealth of Australia (Geoscience Australia) 2015.
+The GNU GPL 2.0 licence is available at: http://www.gnu.org/licenses/gpl-2.0.html. If you require a paper copy of the GNU GPL 2.0 Licence, please write to Free Software Foundation, Inc. 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+Author: Ross C. Brodie, Geoscience Australia.
+*/
+
+#ifndef _outputmerger_H
+#define _outputmerger_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+
+#include "file_utils.h"
+#include "blocklanguage.h"
+#include "logger.h"
+#include "completionjournal.h"
+
+//Merges the per process ASCII output data files of a run into the single DataFile named in the control file.
+//Each process's completion journal gives the record number and end byte of every line it wrote,
+//so lines are copied into the merged file in record order without parsing them.
+//NetCDF output is not merged: each process also writes its own rank suffixed .nc file, and these are left as they are.
+class cOutputMerger {
+
+	class cSegment {
+	public:
+		size_t record = 0;
+		size_t process = 0;
+		int64_t begin = 0;
+		int64_t end = 0;
+	};
+
+	std::string DataFile;
+	int Size = 1;
+	bool KeepProcessFiles = false;
+
+	std::string process_datafile(const int& rank) const {
+		return insert_after_filename(DataFile, stringvalue(rank, ".%04d"));
+	}
+
+	std::string process_file(const int& rank, const std::string& extension) const {
+		sFilePathParts fpp = getfilepathparts(process_datafile(rank));
+		return fpp.directory + fpp.prefix + extension;
+	}
+
+	std::string merged_file(const std::string& extension) const {
+		sFilePathParts fpp = getfilepathparts(DataFile);
+		return fpp.directory + fpp.prefix + extension;
+	}
+
+public:
+
+	//Only the ASCII output of multi-process runs is merged, the per process NetCDF files are excluded
+	static bool required(const cBlock& ob, const int& size) {
+		if (size < 2) return false;
+		std::string fname = ob.getstringvalue("DataFile");
+		if (strcasecmp(extractfileextension(fname), ".nc") == 0) {
+			glog.logmsg(0, "NetCDF output is not merged, each process's .nc file is kept\n");
+			return false;
+		}
+		bool merge = true;
+		ob.getvalue("MergeOutput", merge);
+		return merge;
+	}
+
+	cOutputMerger(const cBlock& ob, const int& size) {
+		DataFile = ob.getstringvalue("DataFile");
+		fixseparator(DataFile);
+		Size = size;
+		if (ob.getvalue("KeepProcessOutput", KeepProcessFiles) == false) {
+			KeepProcessFiles = false;
+		}
+	}
+
+	bool merge() {
+		std::vector<cSegment> segments;
+		for (int p = 0; p < Size; p++) {
+			const std::string df = process_datafile(p);
+			const int64_t datasize = std::filesystem::exists(df) ? (int64_t)std::filesystem::file_size(df) : 0;
+
+			cCompletionJournal j;
+			j.read(process_file(p, ".journal"));
+			std::vector<std::pair<int64_t, size_t>> ends;//end byte and record of each line
+			for (const auto& e : j.entries()) {
+				if (e.second.offset >= 0) ends.push_back({ e.second.offset, e.first });
+			}
+			std::sort(ends.begin(), ends.end());
+
+			int64_t begin = 0;
+			for (const auto& e : ends) {
+				if (e.first > datasize) {
+					glog.logmsg(0, "Output of record %zu is missing from %s, not merging\n", e.second, df.c_str());
+					return false;
+				}
+				//Skipped records do not advance the offset so have no line
+				if (e.first > begin) {
+					segments.push_back({ e.second, (size_t)p, begin, e.first });
+					begin = e.first;
+				}
+			}
+		}
+		std::sort(segments.begin(), segments.end(), [](const cSegment& a, const cSegment& b) { return a.record < b.record; });
+
+		glog.logmsg(0, "Merging %zu records from %d process output files into %s\n", segments.size(), Size, DataFile.c_str());
+		std::vector<std::ifstream> in(Size);
+		for (int p = 0; p < Size; p++) {
+			in[p].open(process_datafile(p), std::ios::binary);
+		}
+
+		std::ofstream out(DataFile, std::ios::binary | std::ios::trunc);
+		std::vector<char> buf;
+		for (const cSegment& s : segments) {
+			const size_t n = (size_t)(s.end - s.begin);
+			buf.resize(n);
+			std::ifstream& f = in[s.process];
+			f.seekg(s.begin);
+			f.read(buf.data(), (std::streamsize)n);
+			if (f.gcount() != (std::streamsize)n) {
+				glog.logmsg(0, "Could not read record %zu from %s, not merging\n", s.record, process_datafile((int)s.process).c_str());
+				out.close();
+				deletefile(DataFile);
+				return false;
+			}
+			out.write(buf.data(), (std::streamsize)n);
+		}
+		out.close();
+		for (int p = 0; p < Size; p++) {
+			in[p].close();
+		}
+
+		//Headers describe every file equally, but a process that wrote no records may not have them,
+		//so each is taken from the first process that does
+		const std::vector<std::string> headers = { ".dfn", ".csv", ".hdr", ".i3" };
+		for (const std::string& h : headers) {
+			for (int p = 0; p < Size; p++) {
+				const std::string src = process_file(p, h);
+				if (std::filesystem::exists(src)) {
+					std::filesystem::copy_file(src, merged_file(h), std::filesystem::copy_options::overwrite_existing);
+					break;
+				}
+			}
+		}
+
+		if (KeepProcessFiles == false) {
+			for (int p = 0; p < Size; p++) {
+				deletefile(process_datafile(p));
+				deletefile(process_file(p, ".journal"));
+				for (const std::string& h : headers) {
+					if (std::filesystem::exists(process_file(p, h))) deletefile(process_file(p, h));
+				}
+			}
+		}
+		return true;
+	}
+};
+
+#endif
@@ -0,0 +1,177 @@
+/*
+This source code file is licensed under the GNU GPL Version 2.0 Licence by the following copyright holder:
+Crown Copyright Commonwealth of Australia (Geoscience Australia) 2015.
+The GNU GPL 2.0 licence is available at: http://www.gnu.org/licenses/gpl-2.0.html. If you require a paper copy of the GNU GPL 2.0 Licence, please write to Free Software Foundation, Inc. 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+Author: Ross C. Brodie, Geoscience Australia.
+*/
+
+#ifndef _phaseprofiler_H
+#define _phaseprofiler_H
+
+#include <array>
+#include <string>
+#include <fstream>
+
+#include "general_utils.h"
+#include "logger.h"
+
+//Phases are timed inclusively, e.g. a lambda trial includes its linear solve and forward models
+enum class ePhase : size_t { FORWARD, JACOBIAN, LINEARSOLVE, LAMBDATRIAL, STEPFACTORTRIAL, INPUT, OUTPUT, COUNT };
+enum class eCounter : size_t { JACOBIANCOLUMNS, INTEGRANDCALLS, COUNT };
+
+class cPhaseProfiler {
+
+	static constexpr size_t NP = (size_t)ePhase::COUNT;
+	static constexpr size_t NC = (size_t)eCounter::COUNT;
+
+	class cTally {
+	public:
+		std::array<double, NP> time{};
+		std::array<size_t, NP> calls{};
+		std::array<size_t, NC> counts{};
+		double elapsed = 0.0;
+		size_t records = 0;
+
+		void add(const cTally& t) {
+			for (size_t i = 0; i < NP; i++) {
+				time[i] += t.time[i];
+				calls[i] += t.calls[i];
+			}
+			for (size_t i = 0; i < NC; i++) {
+				counts[i] += t.counts[i];
+			}
+			elapsed += t.elapsed;
+			records += t.records;
+		}
+	};
+
+	bool Enabled = false;
+	std::string CSVFile;
+	std::string JSONFile;
+	std::ofstream csv;
+	cTally Record;
+	cTally Total;
+	double RecordStartTime = 0.0;
+
+public:
+
+	static std::string phase_name(const size_t& i) {
+		static const std::array<std::string, NP> names = { "forward", "jacobian", "linear_solve", "lambda_trial", "stepfactor_trial", "input", "output" };
+		return names[i];
+	}
+
+	static std::string counter_name(const size_t& i) {
+		static const std::array<std::string, NC> names = { "jacobian_columns", "integrand_calls" };
+		return names[i];
+	}
+
+	cPhaseProfiler() {};
+
+	~cPhaseProfiler() {
+		close();
+	};
+
+	//Per record rows go to basename.profile.csv and the per process totals to basename.profile.json
+	void open(const std::string& basename) {
+		Enabled = true;
+		CSVFile = basename + ".profile.csv";
+		JSONFile = basename + ".profile.json";
+		csv.open(CSVFile, std::ofstream::out);
+		if (csv.is_open() == false) {
+			glog.errormsg(_SRC_, "Could not open profile file %s\n", CSVFile.c_str());
+		}
+
+		csv << "record,status,elapsed";
+		for (size_t i = 0; i < NP; i++) {
+			csv << "," << phase_name(i) << "_time," << phase_name(i) << "_calls";
+		}
+		for (size_t i = 0; i < NC; i++) {
+			csv << "," << counter_name(i);
+		}
+		csv << std::endl;
+	}
+
+	const bool& enabled() const {
+		return Enabled;
+	}
+
+	//Timers may fire from concurrent trial threads
+	void add(const ePhase& phase, const double& t) {
+		#pragma omp critical(phaseprofiler)
+		{
+			Record.time[(size_t)phase] += t;
+			Record.calls[(size_t)phase]++;
+		}
+	}
+
+	void count(const eCounter& counter, const size_t& n = 1) {
+		if (Enabled == false) return;
+		#pragma omp critical(phaseprofiler)
+		Record.counts[(size_t)counter] += n;
+	}
+
+	void begin_record() {
+		Record = cTally();
+		if (Enabled) RecordStartTime = gettime();
+	}
+
+	void end_record(const size_t& record, const std::string& status) {
+		if (Enabled == false) return;
+		Record.elapsed = gettime() - RecordStartTime;
+		Record.records = 1;
+		Total.add(Record);
+
+		csv << record << "," << status << "," << Record.elapsed;
+		for (size_t i = 0; i < NP; i++) {
+			csv << "," << Record.time[i] << "," << Record.calls[i];
+		}
+		for (size_t i = 0; i < NC; i++) {
+			csv << "," << Record.counts[i];
+		}
+		csv << "\n";
+	}
+
+	void close() {
+		if (Enabled == false) return;
+		Enabled = false;
+		csv.close();
+
+		std::ofstream json(JSONFile, std::ofstream::out);
+		json << "{\n";
+		json << "\t\"records\": " << Total.records << ",\n";
+		json << "\t\"elapsed\": " << Total.elapsed << ",\n";
+		json << "\t\"phases\": {\n";
+		for (size_t i = 0; i < NP; i++) {
+			json << "\t\t\"" << phase_name(i) << "\": { \"time\": " << Total.time[i] << ", \"calls\": " << Total.calls[i] << " }";
+			json << (i + 1 < NP ? ",\n" : "\n");
+		}
+		json << "\t},\n";
+		json << "\t\"counters\": {\n";
+		for (size_t i = 0; i < NC; i++) {
+			json << "\t\t\"" << counter_name(i) << "\": " << Total.counts[i];
+			json << (i + 1 < NC ? ",\n" : "\n");
+		}
+		json << "\t}\n";
+		json << "}\n";
+	}
+};
+
+class cScopedPhaseTimer {
+
+	cPhaseProfiler& P;
+	ePhase Phase;
+	double T0 = 0.0;
+
+public:
+
+	cScopedPhaseTimer(cPhaseProfiler& profiler, const ePhase& phase) : P(profiler), Phase(phase) {
+		if (P.enabled()) T0 = gettime();
+	}
+
+	~cScopedPhaseTimer() {
+		if (P.enabled()) P.add(Phase, gettime() - T0);
+	}
+};
+
+#endif
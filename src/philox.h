@@ -0,0 +1,120 @@
+/*
+This source code file is licensed under the GNU GPL Version 2.0 Licence by the following copyright holder:
+Crown Copyright Commonwealth of Australia (Geoscience Australia) 2015.
+The GNU GPL 2.0 licence is available at: http://www.gnu.org/licenses/gpl-2.0.html. If you require a paper copy of the GNU GPL 2.0 Licence, please write to Free Software Foundation, Inc. 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+Author: Ross C. Brodie, Geoscience Australia.
+*/
+
+#ifndef _philox_H
+#define _philox_H
+
+#include <cstdint>
+#include <cmath>
+#include <array>
+
+//Philox4x32-10 counter-based generator (Salmon et al., 2011, Parallel random numbers: as easy as 1, 2, 3).
+//The output is a pure function of the 128 bit counter and 64 bit key, so any stream can be
+//positioned anywhere without generating the numbers before it.
+class cPhilox4x32 {
+
+public:
+
+	typedef std::array<uint32_t, 4> ctr_type;
+	typedef std::array<uint32_t, 2> key_type;
+
+	static ctr_type generate(ctr_type c, key_type k) {
+		for (size_t r = 0; r < 10; r++) {
+			if (r > 0) {
+				k[0] += 0x9E3779B9;
+				k[1] += 0xBB67AE85;
+			}
+			const uint64_t p0 = (uint64_t)0xD2511F53 * c[0];
+			const uint64_t p1 = (uint64_t)0xCD9E8D57 * c[2];
+			c = { (uint32_t)(p1 >> 32) ^ c[1] ^ k[0], (uint32_t)p1, (uint32_t)(p0 >> 32) ^ c[3] ^ k[1], (uint32_t)p0 };
+		}
+		return c;
+	}
+};
+
+//Random number stream keyed by (seed, record, stream, sample).
+//The draws for a sample depend only on those four values, not on how many numbers were drawn before,
+//so results are identical whatever the number of threads or processes sharing the work.
+class cCounterRandomStream {
+
+	cPhilox4x32::key_type Key = { 0, 0 };
+	cPhilox4x32::ctr_type Counter = { 0, 0, 0, 0 };//block within sample, sample, stream, record
+	cPhilox4x32::ctr_type Block = { 0, 0, 0, 0 };
+	size_t Used = 4;
+	bool HaveSpare = false;
+	double Spare = 0.0;
+
+	uint32_t next32() {
+		if (Used == 4) {
+			Block = cPhilox4x32::generate(Counter, Key);
+			Counter[0]++;
+			Used = 0;
+		}
+		return Block[Used++];
+	}
+
+	uint64_t next64() {
+		const uint64_t hi = next32();
+		return (hi << 32) | next32();
+	}
+
+public:
+
+	void seed(const uint64_t& seed, const uint64_t& record, const uint64_t& stream) {
+		Key = { (uint32_t)seed, (uint32_t)(seed >> 32) };
+		Counter = { 0, 0, (uint32_t)stream, (uint32_t)record };
+		Used = 4;
+		HaveSpare = false;
+	}
+
+	//Positions the stream at the first number of a sample
+	void set_sample(const uint64_t& sample) {
+		Counter[0] = 0;
+		Counter[1] = (uint32_t)sample;
+		Used = 4;
+		HaveSpare = false;
+	}
+
+	//Integer in the closed interval [a,b], without modulo bias
+	size_t irand(const size_t& a, const size_t& b) {
+		const uint64_t range = (uint64_t)(b - a) + 1;
+		if (range == 0) return (size_t)next64();//full 64 bit range
+		const uint64_t limit = UINT64_MAX - UINT64_MAX % range;
+		uint64_t x;
+		do {
+			x = next64();
+		} while (x >= limit);
+		return a + (size_t)(x % range);
+	}
+
+	//Uniform in [0,1) with 53 random bits
+	double urand() {
+		return (double)(next64() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	double urand(const double& a, const double& b) {
+		return a + (b - a) * urand();
+	}
+
+	//Standard normal by the Box-Muller transform
+	double nrand() {
+		if (HaveSpare) {
+			HaveSpare = false;
+			return Spare;
+		}
+		const double u1 = 1.0 - urand();//in (0,1]
+		const double u2 = urand();
+		const double r = std::sqrt(-2.0 * std::log(u1));
+		const double t = 6.283185307179586 * u2;
+		Spare = r * std::sin(t);
+		HaveSpare = true;
+		return r * std::cos(t);
+	}
+};
+
+#endif
@@ -0,0 +1,80 @@
+/*
+This source code file is licensed under the GNU GPL Version 2.0 Licence by the following copyright holder:
+Crown Copyright Commonwealth of Australia (Geoscience Australia) 2015.
+The GNU GPL 2.0 licence is available at: http://www.gnu.org/licenses/gpl-2.0.html. If you require a paper copy of the GNU GPL 2.0 Licence, please write to Free Software Foundation, Inc. 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+Author: Ross C. Brodie, Geoscience Australia.
+*/
+
+#ifndef _recordqueue_H
+#define _recordqueue_H
+
+#include <cstdint>
+
+#ifdef ENABLE_MPI
+	#include "mpi.h"
+#endif
+
+//Work queue of record tickets shared by all processes of a run.
+//Processes take the next ticket whenever they become free, so a process that draws slow records
+//does not hold up the others as it would with a fixed round robin assignment.
+//With MPI the counter is a single integer in a one sided communication window on rank 0,
+//incremented atomically with MPI_Fetch_and_op, so no process has to act as a dispatcher.
+//Construction and destruction are collective over MPI_COMM_WORLD.
+//Rank 0 also works on records and may make no MPI calls for long stretches, so the queue needs an MPI
+//with asynchronous progress for one sided operations (hardware atomics, or e.g. MPICH_ASYNC_PROGRESS=1).
+//Without it a ticket request waits until rank 0 next enters MPI and processes fall into step with rank 0.
+class cRecordQueue {
+
+	uint64_t Local = 0;
+#ifdef ENABLE_MPI
+	MPI_Win Win = MPI_WIN_NULL;
+	uint64_t* Counter = nullptr;
+#endif
+
+public:
+
+	cRecordQueue() {
+#ifdef ENABLE_MPI
+		int rank;
+		MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+		const MPI_Aint bytes = rank == 0 ? (MPI_Aint)sizeof(uint64_t) : 0;
+		MPI_Win_allocate(bytes, sizeof(uint64_t), MPI_INFO_NULL, MPI_COMM_WORLD, &Counter, &Win);
+		if (rank == 0) {
+			MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, Win);
+			*Counter = 0;
+			MPI_Win_unlock(0, Win);
+		}
+		//Nobody takes a ticket until the counter is zeroed
+		MPI_Barrier(MPI_COMM_WORLD);
+		MPI_Win_lock_all(0, Win);
+#endif
+	};
+
+	cRecordQueue(const cRecordQueue&) = delete;
+	cRecordQueue& operator=(const cRecordQueue&) = delete;
+
+	~cRecordQueue() {
+#ifdef ENABLE_MPI
+		if (Win != MPI_WIN_NULL) {
+			MPI_Win_unlock_all(Win);
+			MPI_Win_free(&Win);
+		}
+#endif
+	};
+
+	//The next ticket, each ticket being handed to exactly one process
+	uint64_t next() {
+#ifdef ENABLE_MPI
+		const uint64_t one = 1;
+		uint64_t ticket = 0;
+		MPI_Fetch_and_op(&one, &ticket, MPI_UINT64_T, 0, 0, MPI_SUM, Win);
+		MPI_Win_flush(0, Win);
+		return ticket;
+#else
+		return Local++;
+#endif
+	}
+};
+
+#endif
@@ -17,12 +17,20 @@ Richard L. Taylor, Geoscience Australia.
 #include <cfloat>
 #include <memory>
 #include <iomanip>
+#include <iterator>
+#include <algorithm>
+#include <complex>
+
+#if defined _OPENMP
+	#include <omp.h>
+#endif
 
 //custom headers
 #include "general_utils.h"
 #include "random_utils.h"
 #include "vector_utils.h"
 #include "ptrvec.h"
+#include "philox.h"
 
 //third-party headers
 #ifdef ENABLE_MPI
@@ -97,7 +105,7 @@ class cParameterization {
 class cProposal {
 
 	public:
-		enum class Type { VALUECHANGE, BIRTH, DEATH, MOVE, NUISANCE, NOISE };
+		enum class Type { VALUECHANGE, BIRTH, DEATH, MOVE, NUISANCE, NOISE, SCREEN };
 		Type type;
 		uint32_t np = 0;
 		uint32_t na = 0;
@@ -223,6 +231,7 @@ class rjMcMC1DModel{
 	double vmin;
 	double vmax;
 	double misfit;
+	double surrogatemisfit = DBL_MAX;//misfit from the cheap forward model used for delayed acceptance, DBL_MAX if not computed
 
 	std::vector<double> predicted;//the predicted data (forward model)
 	//parameters for noise inversion
@@ -249,6 +258,7 @@ public:
 		mnoises.clear();
 
 		misfit = DBL_MAX;
+		surrogatemisfit = DBL_MAX;
 		pmax = maxp;
 
 		vmin = minv;
@@ -281,6 +291,18 @@ public:
 		misfit = mfit;
 	}
 
+	const double& get_surrogate_misfit() const { return surrogatemisfit; }
+
+	bool has_surrogate_misfit() const { return surrogatemisfit != DBL_MAX; }
+
+	void set_surrogate_misfit(const double mfit) {
+		surrogatemisfit = mfit;
+	}
+
+	void clear_surrogate_misfit() {
+		surrogatemisfit = DBL_MAX;
+	}
+
 	void set_predicted(const std::vector<double>& _predicted) {
 		predicted = _predicted;
 	}
@@ -458,11 +480,136 @@ public:
 	}
 };
 
+//Compact copy of a model kept in the ensemble and chain history.
+//Interface depths and values are quantised to 16 bits over the prior bounds,
+//finer than the PPD map bins, and the other quantities are kept as floats.
+class cPackedModel {
+
+public:
+	float misfit = 0.0f;
+	std::vector<uint16_t> ptop;
+	std::vector<uint16_t> value;
+	std::vector<float> nuisance;
+	std::vector<float> noise;
+	std::vector<float> predicted;
+
+	static uint16_t quantise(const double& x, const double& lo, const double& hi) {
+		const double t = (x - lo) / (hi - lo);
+		if (t <= 0.0) return 0;
+		if (t >= 1.0) return UINT16_MAX;
+		return (uint16_t)std::lround(t * (double)UINT16_MAX);
+	}
+
+	static double dequantise(const uint16_t& q, const double& lo, const double& hi) {
+		return lo + (hi - lo) * (double)q / (double)UINT16_MAX;
+	}
+
+	void pack(const rjMcMC1DModel& m, const double& pmax, const double& vmin, const double& vmax, const bool withpredicted) {
+		misfit = (float)m.get_misfit();
+		ptop.resize(m.nlayers());
+		value.resize(m.nlayers());
+		for (size_t li = 0; li < m.nlayers(); li++) {
+			ptop[li] = quantise(m.layers[li].ptop, 0.0, pmax);
+			value[li] = quantise(m.layers[li].value, vmin, vmax);
+		}
+		nuisance.resize(m.nnuisances());
+		for (size_t ni = 0; ni < m.nnuisances(); ni++) {
+			nuisance[ni] = (float)m.nuisances[ni]->value;
+		}
+		noise.resize(m.nnoises());
+		for (size_t ni = 0; ni < m.nnoises(); ni++) {
+			noise[ni] = (float)m.mnoises[ni].value;
+		}
+		predicted.clear();
+		if (withpredicted) {
+			const std::vector<double>& p = m.get_predicted();
+			predicted.assign(p.begin(), p.end());
+		}
+	}
+
+	size_t nlayers() const { return ptop.size(); }
+};
+
+//Fixed size uniform random sample of all the models offered to it.
+//Each model gets a uniform random key and the models with the smallest keys are kept,
+//so merging two reservoirs by key is again a uniform sample of everything offered to either.
+class cModelReservoir {
+
+	size_t Capacity = 0;
+	size_t NOffered = 0;
+	double MisfitSum = 0.0;
+	std::vector<std::pair<double, cPackedModel>> Heap;//max-heap on key
+
+	static bool keyless(const std::pair<double, cPackedModel>& a, const std::pair<double, cPackedModel>& b) {
+		return a.first < b.first;
+	}
+
+	void insert(const double& key, cPackedModel&& m) {
+		if (Heap.size() == Capacity) {
+			std::pop_heap(Heap.begin(), Heap.end(), keyless);
+			Heap.pop_back();
+		}
+		Heap.emplace_back(key, std::move(m));
+		std::push_heap(Heap.begin(), Heap.end(), keyless);
+	}
+
+public:
+
+	void initialise(const size_t& capacity) {
+		Capacity = capacity;
+		NOffered = 0;
+		MisfitSum = 0.0;
+		Heap.clear();
+		Heap.reserve(capacity);
+	}
+
+	size_t size() const { return Heap.size(); }
+
+	size_t noffered() const { return NOffered; }
+
+	//Mean misfit of every model offered, not only of those kept
+	double misfit_mean() const { return NOffered > 0 ? MisfitSum / (double)NOffered : 0.0; }
+
+	//Counts an offered model and says whether it should be packed and kept
+	bool offer(const double& key, const double& misfit) {
+		NOffered++;
+		MisfitSum += misfit;
+		if (Capacity == 0) return false;
+		return Heap.size() < Capacity || key < Heap.front().first;
+	}
+
+	void keep(const double& key, cPackedModel&& m) {
+		insert(key, std::move(m));
+	}
+
+	void merge(cModelReservoir& r) {
+		NOffered += r.NOffered;
+		MisfitSum += r.MisfitSum;
+		for (auto& e : r.Heap) {
+			if (Heap.size() < Capacity || e.first < Heap.front().first) {
+				insert(e.first, std::move(e.second));
+			}
+		}
+		r.Heap.clear();
+	}
+
+	//Kept models in key order
+	std::vector<const cPackedModel*> models() const {
+		std::vector<const std::pair<double, cPackedModel>*> e(Heap.size());
+		for (size_t i = 0; i < Heap.size(); i++) e[i] = &Heap[i];
+		std::sort(e.begin(), e.end(), [](const auto* a, const auto* b) { return a->first < b->first; });
+		std::vector<const cPackedModel*> m(e.size());
+		for (size_t i = 0; i < e.size(); i++) m[i] = &e[i]->second;
+		return m;
+	}
+};
+
 class rjMcMC1DNoiseMap {
 private:
 	size_t nentries = 0;
 	std::vector<std::pair<size_t,size_t>> datalims; //bounds for each noise process
 	size_t nnoises = 0;
+	size_t capacity = 0;//samples reserved for each noise process so adding a model does not reallocate
 public:
 	size_t get_nnoises() const { return nnoises; }
 
@@ -480,6 +627,13 @@ public:
 		nnoises = 0;
 	}
 
+	void reserve(const size_t& n) {
+		capacity = n;
+		for (size_t i = 0; i < noises.size(); i++) {
+			noises[i].reserve(n);
+		}
+	}
+
 	void addmodel(const rjMcMC1DModel& m) {
 		if (noises.size() != m.nnoises()) {
 			nnoises = m.nnoises();
@@ -487,6 +641,7 @@ public:
 			datalims.resize(m.nnoises());
 			for (size_t i = 0; i < m.nnoises(); i++) {
 				datalims[i] = m.mnoises[i].data_bounds;
+				noises[i].reserve(capacity);
 			}
 		}
 
@@ -496,6 +651,21 @@ public:
 		nentries++;
 	}
 
+	//Appends the samples of another map, used to combine the per chain maps
+	void addmap(const rjMcMC1DNoiseMap& m) {
+		if (m.nentries == 0) return;
+		if (noises.size() != m.noises.size()) {
+			nnoises = m.nnoises;
+			noises.resize(m.noises.size());
+			datalims = m.datalims;
+			reserve(capacity);
+		}
+		for (size_t i = 0; i < noises.size(); i++) {
+			noises[i].insert(noises[i].end(), m.noises[i].begin(), m.noises[i].end());
+		}
+		nentries += m.nentries;
+	}
+
 	void writedata(FILE* fp) {
 		size_t nn = noises.size();
 		for (size_t i = 0; i < nn; i++) {
@@ -549,6 +719,7 @@ class rjMcMC1DNuisanceMap{
 private:
 	size_t nentries=0;
 	std::vector<std::string> typestring;
+	size_t capacity = 0;//samples reserved for each nuisance so adding a model does not reallocate
 
 public:
 
@@ -570,6 +741,13 @@ public:
 		nentries = 0;
 	}
 
+	void reserve(const size_t& n) {
+		capacity = n;
+		for (size_t i = 0; i < nuisance.size(); i++) {
+			nuisance[i].reserve(n);
+		}
+	}
+
 	void addmodel(const rjMcMC1DModel& m)
 	{
 		if (nuisance.size() != m.nnuisances()){
@@ -577,6 +755,7 @@ public:
 			typestring.resize(m.nnuisances());
 			for (size_t i = 0; i < nuisance.size(); i++){
 				typestring[i] = m.nuisances[i]->typestring();
+				nuisance[i].reserve(capacity);
 			}
 		}
 
@@ -587,6 +766,21 @@ public:
 		nentries++;
 	}
 
+	//Appends the samples of another map, used to combine the per chain maps
+	void addmap(const rjMcMC1DNuisanceMap& m)
+	{
+		if (m.nentries == 0) return;
+		if (nuisance.size() != m.nuisance.size()) {
+			nuisance.resize(m.nuisance.size());
+			typestring = m.typestring;
+			reserve(capacity);
+		}
+		for (size_t i = 0; i < nuisance.size(); i++) {
+			nuisance[i].insert(nuisance[i].end(), m.nuisance[i].begin(), m.nuisance[i].end());
+		}
+		nentries += m.nentries;
+	}
+
 	void writedata(FILE* fp)
 	{
 		size_t nn = nuisance.size();
@@ -680,13 +874,13 @@ public:
 
 	const std::vector<uint32_t>& changepoint(){ return cpcounts; }
 
-	size_t getvbin(double val){
+	size_t getvbin(double val) const {
 		if (val < vmin)return 0;
 		if (val >= vmax)return nv-1;
 		return (size_t)((val-vmin)/dv);
 	}
 
-	size_t getpbin(double pos){
+	size_t getpbin(double pos) const {
 		if (pos < 0.0)return 0;
 		if (pos >= pmax)return np-1;
 		return (size_t)(pos/dp);
@@ -735,10 +929,18 @@ public:
 
 		layercounts[m.nlayers()-nlmin]++;
 
-		for(size_t pi=0; pi<np; pi++){
-			size_t li = m.which_layer(pbin[pi]);
-			size_t vi = getvbin(m.layers[li].value);
-			counts[pi*nv+vi]++;
+		//Each layer covers the contiguous run of position bins whose centres lie between its top and the
+		//top of the next layer, the same bins which_layer() would give, so no per bin search is needed
+		const size_t nl = m.nlayers();
+		size_t p0 = 0;
+		for (size_t li = 0; li < nl && p0 < np; li++) {
+			size_t p1 = np;
+			if (li + 1 < nl) {
+				p1 = (size_t)(std::lower_bound(pbin.begin() + p0, pbin.end(), m.layers[li + 1].ptop) - pbin.begin());
+			}
+			uint32_t* c = &counts[p0 * nv + getvbin(m.layers[li].value)];
+			for (size_t pi = p0; pi < p1; pi++, c += nv) (*c)++;
+			p0 = p1;
 		}
 
 		for(size_t li=1; li<m.nlayers(); li++){
@@ -748,6 +950,15 @@ public:
 
 	}
 
+	//Adds the counts of another map with the same bins, used to combine the per chain maps
+	void addmap(const rjMcMC1DPPDMap& m)
+	{
+		nentries += m.nentries;
+		for (size_t i = 0; i < counts.size(); i++) counts[i] += m.counts[i];
+		for (size_t i = 0; i < cpcounts.size(); i++) cpcounts[i] += m.cpcounts[i];
+		for (size_t i = 0; i < layercounts.size(); i++) layercounts[i] += m.layercounts[i];
+	}
+
 	std::vector<double> modelmap(const rjMcMC1DModel& m)
 	{
 		std::vector<double> model(np);
@@ -817,7 +1028,154 @@ public:
 	std::vector<float> ar_death;
 	std::vector<float> ar_nuisancechange;
 	std::vector<float> ar_noisechange;
-	std::vector<rjMcMC1DModel> models;
+	std::vector<float> ar_screen;
+	std::vector<cPackedModel> models;
+	size_t nstreamed = 0;//models already written to the maps file and released
+};
+
+//Convergence diagnostics over the temperature 1 sample sequences
+class cConvergenceDiagnostics {
+
+	static void meanvar(const float* x, const size_t& n, double& mean, double& var) {
+		double s = 0.0;
+		for (size_t i = 0; i < n; i++) s += x[i];
+		mean = s / (double)n;
+		double ss = 0.0;
+		for (size_t i = 0; i < n; i++) ss += (x[i] - mean) * (x[i] - mean);
+		var = n > 1 ? ss / (double)(n - 1) : 0.0;
+	}
+
+public:
+
+	//Split R-hat (Gelman et al., Bayesian Data Analysis 3rd ed.), each series is halved so a single chain can be checked.
+	//Series shorter than 4 are ignored and the rest truncated to the shortest.
+	static double rhat(const std::vector<const std::vector<float>*>& series) {
+		size_t n = SIZE_MAX;
+		size_t nseries = 0;
+		for (const auto* s : series) {
+			if (s->size() < 4) continue;
+			n = std::min(n, s->size() / 2);
+			nseries++;
+		}
+		if (nseries == 0) return DBL_MAX;
+
+		std::vector<double> means;
+		std::vector<double> vars;
+		for (const auto* s : series) {
+			if (s->size() < 4) continue;
+			for (size_t h = 0; h < 2; h++) {
+				double mean, var;
+				meanvar(s->data() + s->size() - (2 - h) * n, n, mean, var);
+				means.push_back(mean);
+				vars.push_back(var);
+			}
+		}
+
+		const size_t m = means.size();
+		double grandmean = 0.0;
+		for (size_t j = 0; j < m; j++) grandmean += means[j] / (double)m;
+		double B = 0.0;
+		double W = 0.0;
+		for (size_t j = 0; j < m; j++) {
+			B += (means[j] - grandmean) * (means[j] - grandmean);
+			W += vars[j] / (double)m;
+		}
+		B *= (double)n / (double)(m - 1);
+		if (W <= 0.0) return B > 0.0 ? DBL_MAX : 1.0;
+		const double varplus = (double)(n - 1) / (double)n * W + B / (double)n;
+		return std::sqrt(varplus / W);
+	}
+
+	//In place iterative radix-2 transform, a.size() must be a power of 2
+	static void fft(std::vector<std::complex<double>>& a, const bool& inverse) {
+		const size_t n = a.size();
+		for (size_t i = 1, j = 0; i < n; i++) {
+			size_t bit = n >> 1;
+			for (; j & bit; bit >>= 1) j ^= bit;
+			j ^= bit;
+			if (i < j) std::swap(a[i], a[j]);
+		}
+		for (size_t len = 2; len <= n; len <<= 1) {
+			const double ang = 6.283185307179586 / (double)len * (inverse ? 1.0 : -1.0);
+			const std::complex<double> wlen(std::cos(ang), std::sin(ang));
+			for (size_t i = 0; i < n; i += len) {
+				std::complex<double> w(1.0, 0.0);
+				for (size_t k = 0; k < len / 2; k++) {
+					const std::complex<double> u = a[i + k];
+					const std::complex<double> v = a[i + k + len / 2] * w;
+					a[i + k] = u + v;
+					a[i + k + len / 2] = u - v;
+					w *= wlen;
+				}
+			}
+		}
+	}
+
+	//Effective sample size of one series by Geyer's initial positive sequence, capped at the series length.
+	//The autocorrelations come from one zero padded FFT, so a check costs O(n log n) however long the correlation.
+	static double ess(const std::vector<float>& x) {
+		const size_t n = x.size();
+		if (n < 4) return (double)n;
+		double mean, var;
+		meanvar(x.data(), n, mean, var);
+		if (var <= 0.0) return (double)n;
+
+		size_t m = 1;
+		while (m < 2 * n) m <<= 1;
+		std::vector<std::complex<double>> a(m, 0.0);
+		for (size_t i = 0; i < n; i++) a[i] = x[i] - mean;
+		fft(a, false);
+		for (size_t i = 0; i < m; i++) a[i] = std::norm(a[i]);
+		fft(a, true);
+
+		auto rho = [&](const size_t& t) {
+			return a[t].real() / (double)m / (double)(n - 1) / var;
+		};
+
+		double tau = -1.0;
+		for (size_t k = 0; 2 * k + 1 < n; k++) {
+			const double g = (k == 0 ? 1.0 : rho(2 * k)) + rho(2 * k + 1);
+			if (g <= 0.0) break;
+			tau += 2.0 * g;
+		}
+		return std::min((double)n, (double)n / std::max(tau, 1.0 / (double)n));
+	}
+
+	//Largest total variation distance between the normalised conductivity histograms of any depth cell of two maps
+	static double ppd_change(const std::vector<uint32_t>& a, const size_t& na, const std::vector<uint32_t>& b, const size_t& nb, const size_t& nv) {
+		if (na == 0 || nb == 0 || a.size() != b.size()) return 1.0;
+		double change = 0.0;
+		for (size_t r = 0; r < a.size() / nv; r++) {
+			double tv = 0.0;
+			for (size_t vi = 0; vi < nv; vi++) {
+				const size_t i = r * nv + vi;
+				tv += std::fabs((double)a[i] / (double)na - (double)b[i] / (double)nb);
+			}
+			change = std::max(change, tv / 2.0);
+		}
+		return change;
+	}
+};
+
+//Diagnostics of the whole sampler at each convergence check. They are kept apart from cChainHistory
+//because they are not per chain and are taken every ConvergenceInterval samples rather than at the
+//convergence records, so they cannot share its chain by convergence_sample dimensions in the maps file.
+class cConvergenceHistory {
+
+public:
+	std::vector<uint32_t> sample;
+	std::vector<float> rhat_misfit;
+	std::vector<float> rhat_nlayers;
+	std::vector<float> ess;
+	std::vector<float> ppd_change;
+
+	void clear() {
+		sample.clear();
+		rhat_misfit.clear();
+		rhat_nlayers.clear();
+		ess.clear();
+		ppd_change.clear();
+	}
 };
 
 class rjMcMC1DSampler;
@@ -834,11 +1192,23 @@ public:
 	cProposal pdeath = cProposal(cProposal::Type::DEATH);
 	cProposal pnuisancechange = cProposal(cProposal::Type::NUISANCE);
 	cProposal pnoisechange = cProposal(cProposal::Type::NOISE);
+	cProposal pscreen = cProposal(cProposal::Type::SCREEN);//proposals passing the first stage of delayed acceptance
 
 	cChainHistory history;
 	std::vector<uint32_t> swap_histogram;
 	double temperature;
+	size_t slot;//position in the temperature ladder, exchanged along with the temperature at swaps
 	rjMcMC1DModel model;
+	cCounterRandomStream random;
+
+	//Samples taken while this chain was at temperature 1, combined over all chains after sampling
+	rjMcMC1DPPDMap pmap;
+	rjMcMC1DNuisanceMap nmap;
+	rjMcMC1DNoiseMap mnmap;
+	cModelReservoir ensemble;
+	bool hasbest = false;
+	rjMcMC1DModel highestlikelihood;
+	rjMcMC1DModel lowestmisfit;
 };
 
 class rjMcMC1DSampler{
@@ -857,6 +1227,12 @@ public:
 	std::string endtime;
 	double samplingtime;
 
+	size_t ChainThreads = 1;//Number of threads advancing the chains concurrently
+	bool InChainRegion = false;
+	uint64_t RandomSeed = 0;
+	uint64_t RecordKey = 0;//Identifies the sounding being sampled in the random number streams
+	cCounterRandomStream SwapRandom;
+
 	ptr_vec<rjMcMCNuisance> nuisance_init;
 
 	//parameters for noise prior
@@ -873,17 +1249,43 @@ public:
 	cParameterization param_value;
 
 	size_t nsamples;
+	size_t nsamples_run = 0;//less than nsamples when sampling stopped at convergence
 	size_t nburnin;
 	size_t thinrate;
 	double temperature_high;//lowest is always 1.0
 
 	bool BirthDeathFromPrior;
+	bool DelayedAcceptance = false;//Screen proposals with forwardmodel_surrogate() before running the full forward model
+	size_t MultipleTryCandidates = 1;//Candidates per value change and move proposal, multiple-try Metropolis when more than 1
 
 	rjMcMC1DPPDMap pmap;
 	rjMcMC1DNuisanceMap nmap;
 	rjMcMC1DNoiseMap mnmap;
 	std::vector<cChain> chains;
-	std::vector<rjMcMC1DModel> ensemble;
+	cModelReservoir ensemble;
+	size_t ConvergenceInterval = 0;//Samples between convergence checks after burn-in, 0 for no checks
+	bool   StopWhenConverged = false;
+	double RhatThreshold = 1.05;
+	double MinimumESS = 200.0;
+	double PPDChangeThreshold = 0.02;
+	cConvergenceHistory convergence;
+	//Sample sequence of each temperature ladder slot at temperature 1, whichever chain holds it at the time.
+	//Parallel tempering passes temperature 1 between chains, so a per chain record would be made of disjoint
+	//stretches and understate the autocorrelation.
+	std::vector<std::vector<float>> trace_misfit;//[slot][sample]
+	std::vector<std::vector<float>> trace_nlayers;
+	std::vector<uint32_t> PPDCheckpoint;//combined PPD counts at the previous convergence check
+	size_t PPDCheckpointEntries = 0;
+	bool StopSampling = false;
+
+	size_t EnsembleSize = 1000;//Number of models kept in the ensemble by reservoir sampling
+	bool KeepChainModels = true;//Keep the models of the convergence records for writing to the maps file
+
+	//Open maps file when chain models are streamed to it during sampling
+	NcFile* StreamFile = nullptr;
+	NcVar StreamPTop;
+	NcVar StreamValue;
+	NcVar StreamPredicted;
 	rjMcMC1DModel  HighestLikelihood;
 	rjMcMC1DModel  LowestMisfit;
 
@@ -917,6 +1319,14 @@ public:
 
 	size_t nchains() const { return chains.size(); };
 
+	//Index of the forward model engine the calling thread may use
+	size_t chain_engine() const {
+#if defined _OPENMP
+		if (InChainRegion) return (size_t)omp_get_thread_num();
+#endif
+		return 0;
+	}
+
 	void addmodel(const rjMcMC1DModel& m)
 	{
 		pmap.addmodel(m);
@@ -926,6 +1336,21 @@ public:
 
 	virtual std::vector<double> forwardmodel(const rjMcMC1DModel& m) = 0;
 
+	//Forward models of several models, overridden where setup can be shared between them
+	virtual std::vector<std::vector<double>> forwardmodel_batch(const std::vector<const rjMcMC1DModel*>& models) {
+		std::vector<std::vector<double>> pred(models.size());
+		for (size_t k = 0; k < models.size(); k++) {
+			pred[k] = forwardmodel(*models[k]);
+		}
+		return pred;
+	}
+
+	//Cheap approximation of forwardmodel() used to screen proposals when DelayedAcceptance is set.
+	//It must be a deterministic function of the model, its accuracy only affects efficiency not the posterior.
+	virtual std::vector<double> forwardmodel_surrogate(const rjMcMC1DModel& m) {
+		return forwardmodel(m);
+	}
+
 	size_t nnuisances()
 	{
 		return nuisance_init.size();
@@ -975,7 +1400,10 @@ public:
 
 	void compute_predicted_and_residuals_squared(rjMcMC1DModel& m) {
 		//bookmark
-		std::vector<double> pred = forwardmodel(m);				
+		set_predicted_and_residuals_squared(m, forwardmodel(m));
+	}
+
+	void set_predicted_and_residuals_squared(rjMcMC1DModel& m, const std::vector<double>& pred) {
 		std::vector<double> res2(ndata);
 		for (size_t di = 0; di < ndata; di++){
 			double rd = (obs[di]-pred[di])/obs[di];			
@@ -996,7 +1424,23 @@ public:
 		//return;
 				
 		compute_predicted_and_residuals_squared(m);
+		set_misfit_from_residuals(m);
+	}
+
+	//Sets the misfits of several models with one forwardmodel_batch() call
+	void set_misfit_batch(const std::vector<rjMcMC1DModel*>& models)
+	{
+		if (models.size() == 0) return;
+		const std::vector<const rjMcMC1DModel*> cm(models.begin(), models.end());
+		const std::vector<std::vector<double>> pred = forwardmodel_batch(cm);
+		for (size_t k = 0; k < models.size(); k++) {
+			set_predicted_and_residuals_squared(*models[k], pred[k]);
+			set_misfit_from_residuals(*models[k]);
+		}
+	}
 
+	void set_misfit_from_residuals(rjMcMC1DModel& m)
+	{
 		const std::vector<double>& res2 = m.get_residuals_squared();
 		double negloglike = 0.0;
 		for (size_t di = 0; di < ndata; di++) {			
@@ -1009,6 +1453,130 @@ public:
 		m.set_misfit(negloglike);		
 	}
 
+	void set_surrogate_misfit(rjMcMC1DModel& m)
+	{
+		const std::vector<double> pred = forwardmodel_surrogate(m);
+		double negloglike = 0.0;
+		for (size_t di = 0; di < ndata; di++) {
+			const double rd = (obs[di] - pred[di]) / obs[di];
+			negloglike += rd * rd / m.nvar[di] + std::log(m.nvar[di]);
+		}
+		m.set_surrogate_misfit(negloglike);
+	}
+
+	//Metropolis-Hastings test of the proposal mpro against the chain's current model,
+	//logpqr being the log of the prior and proposal ratio.
+	//With DelayedAcceptance the proposal is first screened with the surrogate misfit and the full forward
+	//model is only run for proposals that pass. The second stage divides out the surrogate likelihood ratio
+	//so the chain still samples the exact posterior (Christen and Fox, 2005).
+	bool metropolis(cChain& chn, rjMcMC1DModel& mpro, const double& logpqr)
+	{
+		rjMcMC1DModel& mcur = chn.model;
+		const double& temperature = chn.temperature;
+		if (DelayedAcceptance == false) {
+			set_misfit(mpro);
+			const double loglr = -(mpro.get_misfit() - mcur.get_misfit()) / 2.0 / temperature;
+			return std::log(chn.random.urand()) < logpqr + loglr;
+		}
+
+		if (mcur.has_surrogate_misfit() == false) set_surrogate_misfit(mcur);
+		set_surrogate_misfit(mpro);
+		chn.pscreen.inc_np();
+		const double logslr = -(mpro.get_surrogate_misfit() - mcur.get_surrogate_misfit()) / 2.0 / temperature;
+		const bool screened = std::log(chn.random.urand()) < logpqr + logslr;
+		if (screened == false) return false;
+		chn.pscreen.inc_na();
+
+		set_misfit(mpro);
+		const double loglr = -(mpro.get_misfit() - mcur.get_misfit()) / 2.0 / temperature;
+		return std::log(chn.random.urand()) < loglr - logslr;
+	}
+
+	static double log_sum_exp(const std::vector<double>& a)
+	{
+		const double amax = *std::max_element(a.begin(), a.end());
+		if (std::isfinite(amax) == false) return amax;
+		double s = 0.0;
+		for (size_t i = 0; i < a.size(); i++) {
+			s += std::exp(a[i] - amax);
+		}
+		return amax + std::log(s);
+	}
+
+	//Multiple-try Metropolis (Liu, Liang and Wong, 2000) for a proposal that perturbs one scalar parameter x of the
+	//current model by a Gaussian of standard deviation sd(x). apply(m, xfrom, xto) changes the parameter of a copy
+	//of the model and returns false if the result is outside the prior.
+	//The MultipleTryCandidates candidates are evaluated in one forwardmodel_batch() call and one is selected in
+	//proportion to its weight pi(y)q(y->x). It is then accepted against reference points drawn from it, evaluated
+	//in a second batch, plus the current model.
+	template<typename Apply, typename StdDev>
+	bool multiple_try(cChain& chn, rjMcMC1DModel& mpro, const double& xcur, Apply apply, StdDev sd)
+	{
+		const rjMcMC1DModel& mcur = chn.model;
+		const double& temperature = chn.temperature;
+		const size_t K = MultipleTryCandidates;
+
+		auto logweight = [&](const rjMcMC1DModel& m, const double& x, const double& xto) {
+			const double lw = -m.get_misfit() / 2.0 / temperature + std::log(gaussian_pdf(x, sd(x), xto));
+			return std::isnan(lw) ? -INFINITY : lw;
+		};
+
+		std::vector<rjMcMC1DModel> y(K, mcur);
+		std::vector<double> xy(K);
+		std::vector<bool> valid(K);
+		std::vector<rjMcMC1DModel*> eval;
+		for (size_t k = 0; k < K; k++) {
+			xy[k] = xcur + sd(xcur) * chn.random.nrand();
+			valid[k] = apply(y[k], xcur, xy[k]);
+			y[k].clear_surrogate_misfit();
+			if (valid[k]) eval.push_back(&y[k]);
+		}
+		set_misfit_batch(eval);
+
+		std::vector<double> logw(K, -INFINITY);
+		for (size_t k = 0; k < K; k++) {
+			if (valid[k]) logw[k] = logweight(y[k], xy[k], xcur);
+		}
+		const double logsumy = log_sum_exp(logw);
+		if (std::isfinite(logsumy) == false) return false;
+
+		//Select a candidate in proportion to its weight
+		const double u = chn.random.urand();
+		double cdf = 0.0;
+		size_t j = K;
+		for (size_t k = 0; k < K; k++) {
+			if (logw[k] == -INFINITY) continue;
+			j = k;
+			cdf += std::exp(logw[k] - logsumy);
+			if (u < cdf) break;
+		}
+
+		//Reference points drawn from the selected candidate, the last being the current model
+		std::vector<rjMcMC1DModel> r(K - 1, y[j]);
+		std::vector<double> xr(K - 1);
+		std::vector<bool> rvalid(K - 1);
+		eval.clear();
+		for (size_t k = 0; k < K - 1; k++) {
+			xr[k] = xy[j] + sd(xy[j]) * chn.random.nrand();
+			rvalid[k] = apply(r[k], xy[j], xr[k]);
+			if (rvalid[k]) eval.push_back(&r[k]);
+		}
+		set_misfit_batch(eval);
+
+		std::vector<double> logwr(K, -INFINITY);
+		for (size_t k = 0; k < K - 1; k++) {
+			if (rvalid[k]) logwr[k] = logweight(r[k], xr[k], xy[j]);
+		}
+		logwr[K - 1] = logweight(mcur, xcur, xy[j]);
+		const double logsumr = log_sum_exp(logwr);
+
+		if (std::log(chn.random.urand()) < logsumy - logsumr) {
+			mpro = std::move(y[j]);
+			return true;
+		}
+		return false;
+	}
+
 	void set_misfit_noisechange(rjMcMC1DModel& m, double nv, size_t ni) {
 		//reset the misfit for a noise magnitude change, without
 		//recomputing the forward.
@@ -1029,6 +1597,8 @@ public:
 			negloglike += res[di] / m.nvar[di] + std::log(m.nvar[di]);
 		}
 		m.set_misfit(negloglike);
+		//the surrogate misfit depends on the variances and is recomputed when next needed
+		m.clear_surrogate_misfit();
 	}
 
 	bool should_save_convergence_record(const size_t& si)
@@ -1043,36 +1613,47 @@ public:
 	bool propose_valuechange(cChain& chn, rjMcMC1DModel& mpro)
 	{
 		const rjMcMC1DModel& mcur = chn.model;
-		const double& temperature = chn.temperature;
 		chn.pvaluechange.inc_np();
 
-		size_t index = irand((size_t)0, (size_t)(mcur.nlayers() - 1));
+		size_t index = chn.random.irand((size_t)0, (size_t)(mcur.nlayers() - 1));
 
 		double logstd = DEFAULTLOGSTDDECADES;
+		if (MultipleTryCandidates > 1) {
+			const bool linear = param_value.islinear();
+			const double m = (std::pow(10.0, logstd) - std::pow(10.0, -logstd)) / 2.0;
+			auto sd = [&](const double& v) { return linear ? m * v : logstd; };
+			auto apply = [&](rjMcMC1DModel& mm, const double&, const double& vto) {
+				mm.layers[index].value = vto;
+				return isinbounds(vmin, vmax, vto);
+			};
+			if (multiple_try(chn, mpro, mcur.layers[index].value, apply, sd)) {
+				chn.pvaluechange.inc_na();
+				return true;
+			}
+			return false;
+		}
+
 		double vold = mcur.layers[index].value;
 		double vnew;
 		double pqratio;
 		if (param_value.islinear()) {
 			double m = (std::pow(10.0, logstd) - std::pow(10.0, -logstd)) / 2.0;
-			vnew = vold + m * vold * nrand<double>();
+			vnew = vold + m * vold * chn.random.nrand();
 			double qpdfforward = gaussian_pdf(vold, m * vold, vnew);
 			double qpdfreverse = gaussian_pdf(vnew, m * vnew, vold);
 			pqratio = qpdfreverse / qpdfforward;
 		}
 		else {
-			vnew = vold + logstd * nrand<double>();
+			vnew = vold + logstd * chn.random.nrand();
 			pqratio = 1.0;
 		}
 
 		bool isvalid = isinbounds(vmin, vmax, vnew);
 		if (isvalid == false) return false;
 		mpro.layers[index].value = vnew;
-		set_misfit(mpro);
 
 		double logpqr = std::log(pqratio);
-		double loglr = -(mpro.get_misfit() - mcur.get_misfit()) / 2.0 / temperature;
-		double logar = logpqr + loglr;
-		if (std::log(urand<double>()) < logar) {
+		if (metropolis(chn, mpro, logpqr)) {
 			chn.pvaluechange.inc_na();
 			return true;
 		}
@@ -1082,32 +1663,42 @@ public:
 	bool propose_move(cChain& chn, rjMcMC1DModel& mpro)
 	{
 		const rjMcMC1DModel& mcur = chn.model;
-		const double& temperature = chn.temperature;
 		chn.pmove.inc_np();
 
 		size_t n = mcur.nlayers();
 		if (n <= 1)return false;
 
-		size_t index = irand((size_t)1, n - 1);
+		size_t index = chn.random.irand((size_t)1, n - 1);
 		double pold = mcur.layers[index].ptop;
 
+		if (MultipleTryCandidates > 1) {
+			auto sd = [&](const double& p) { return DEFAULTMOVESTDFRACTION * p; };
+			//The interface is found by its position because moving it may reorder the layers
+			auto apply = [&](rjMcMC1DModel& mm, const double& pfrom, const double& pto) {
+				for (size_t li = 1; li < mm.nlayers(); li++) {
+					if (mm.layers[li].ptop == pfrom) return mm.move_interface(li, pto);
+				}
+				return false;
+			};
+			if (multiple_try(chn, mpro, pold, apply, sd)) {
+				chn.pmove.inc_na();
+				return true;
+			}
+			return false;
+		}
+
 		//double std = sd_move;
 		double std = DEFAULTMOVESTDFRACTION * pold;
-		double pnew = pold + std * nrand<double>();
+		double pnew = pold + std * chn.random.nrand();
 		double qpdfforward = gaussian_pdf(pold, pold * DEFAULTMOVESTDFRACTION, pnew);
 		double qpdfreverse = gaussian_pdf(pnew, pnew * DEFAULTMOVESTDFRACTION, pold);
 
 		bool isvalid = mpro.move_interface(index, pnew);
 		if (isvalid == false)return false;
 
-		set_misfit(mpro);
 		double pqratio = qpdfreverse / qpdfforward;
 		double logpqr = std::log(pqratio);
-
-		double loglr = -(mpro.get_misfit() - mcur.get_misfit()) / 2.0 / temperature;
-		double logar = logpqr + loglr;
-		double logu = std::log(urand<double>());
-		if (logu < logar) {
+		if (metropolis(chn, mpro, logpqr)) {
 			chn.pmove.inc_na();
 			return true;
 		}
@@ -1117,19 +1708,18 @@ public:
 	bool propose_birth(cChain& chn, rjMcMC1DModel& mpro)
 	{
 		const rjMcMC1DModel& mcur = chn.model;
-		const double& temperature = chn.temperature;
 		chn.pbirth.inc_np();
 
 		size_t n = mcur.nlayers();
 		if (n >= nl_max)return false;
 
-		double  pos = urand(0.0, pmax);
+		double  pos = chn.random.urand(0.0, pmax);
 		size_t  index = mcur.which_layer(pos);
 		double vold = mcur.layers[index].value;
 		double vnew, pqratio;
 
 		if (BirthDeathFromPrior) {
-			vnew = urand(vmin, vmax);
+			vnew = chn.random.urand(vmin, vmax);
 			pqratio = 1.0;
 		}
 		else {
@@ -1137,11 +1727,11 @@ public:
 			double logstd = DEFAULTLOGSTDDECADES;
 			if (param_value.islinear()) {
 				double m = (std::pow(10.0, logstd) - std::pow(10.0, -logstd)) / 2.0;
-				vnew = vold + m * vold * nrand<double>();
+				vnew = vold + m * vold * chn.random.nrand();
 				vcpdf = gaussian_pdf(vold, m * vold, vnew);
 			}
 			else {
-				vnew = vold + logstd * nrand<double>();
+				vnew = vold + logstd * chn.random.nrand();
 				vcpdf = gaussian_pdf(vold, logstd, vnew);
 			}
 			pqratio = 1.0 / ((vmax - vmin) * vcpdf);
@@ -1152,12 +1742,9 @@ public:
 
 		bool isvalid = mpro.insert_interface(pos, vnew);
 		if (isvalid == false)return false;
-		set_misfit(mpro);
 
 		double logpqr = std::log(pqratio);
-		double loglr  = -(mpro.get_misfit() - mcur.get_misfit()) / 2.0 / temperature;
-		double logar  = logpqr + loglr;
-		if (std::log(urand<double>()) < logar) {
+		if (metropolis(chn, mpro, logpqr)) {
 			chn.pbirth.inc_na();
 			return true;
 		}
@@ -1167,16 +1754,14 @@ public:
 	bool propose_death(cChain& chn, rjMcMC1DModel& mpro)
 	{
 		const rjMcMC1DModel& mcur = chn.model;
-		const double& temperature = chn.temperature;
 		chn.pdeath.inc_np();
 
 		size_t n = mcur.nlayers();
 		if (n <= nl_min)return false;
 
-		size_t index = irand((size_t)1, n - 1);
+		size_t index = chn.random.irand((size_t)1, n - 1);
 		bool isvalid = mpro.delete_interface(index);
 		if (isvalid == false)return false;
-		set_misfit(mpro);
 
 		double pqratio;
 		if (BirthDeathFromPrior) {
@@ -1201,9 +1786,7 @@ public:
 		//pqratio *= (double)(n) / double(n - 1);
 
 		double logpqr = std::log(pqratio);
-		double loglr  = -(mpro.get_misfit() - mcur.get_misfit()) / 2.0 / temperature;
-		double logar  = logpqr + loglr;
-		if (std::log(urand<double>()) < logar) {
+		if (metropolis(chn, mpro, logpqr)) {
 			chn.pdeath.inc_na();
 			return true;
 		}
@@ -1213,13 +1796,12 @@ public:
 	bool propose_nuisancechange(cChain& chn, rjMcMC1DModel& mpro)
 	{
 		const rjMcMC1DModel& mcur = chn.model;
-		const double& temperature = chn.temperature;
 		chn.pnuisancechange.inc_np();
 
-		size_t ni = irand((size_t)0, mcur.nnuisances() - 1);
+		size_t ni = chn.random.irand((size_t)0, mcur.nnuisances() - 1);
 
 		
-		double delta = nrand<double>() * mcur.nuisances[ni]->sd_valuechange;		
+		double delta = chn.random.nrand() * mcur.nuisances[ni]->sd_valuechange;		
 		double nv = mcur.nuisances[ni]->value + delta;
 		
 		bool isvalid = isinbounds(mcur.nuisances[ni]->min, mcur.nuisances[ni]->max, nv);
@@ -1229,10 +1811,7 @@ public:
 		//std::cout << "nv    = " << nv << std::endl;
 		mpro.nuisances[ni]->value = nv;
 
-		set_misfit(mpro);
-		double loglr = -(mpro.get_misfit() - mcur.get_misfit()) / 2.0 / temperature;
-		double logu = log(urand<double>());
-		if (logu < loglr) {
+		if (metropolis(chn, mpro, 0.0)) {
 			chn.pnuisancechange.inc_na();
 			return true;
 		}
@@ -1248,8 +1827,8 @@ public:
 
 		//propose a change to the multiplicative noise magnitudes.
 		//one multiplicative noise per system.
-		size_t ni = irand((size_t)0, mcur.nnoises() - 1);
-		double delta = nrand<double>() * mcur.mnoises[ni].sd_valuechange;
+		size_t ni = chn.random.irand((size_t)0, mcur.nnoises() - 1);
+		double delta = chn.random.nrand() * mcur.mnoises[ni].sd_valuechange;
 		double nv = mcur.mnoises[ni].value + delta;
 		bool isvalid = isinbounds(mcur.mnoises[ni].min, mcur.mnoises[ni].max, nv);
 		if (isvalid == false) return false;
@@ -1261,7 +1840,7 @@ public:
 		//because this changes when we change the variance of the distribution.
 		//see my notes on noise changes for details.
 		double loglr = -(mpro.get_misfit() - mcur.get_misfit()) / 2.0 / temperature;
-		double logu = log(urand<double>());
+		double logu = log(chn.random.urand());
 		if (logu < loglr) {
 			chn.pnoisechange.inc_na();
 			return true;
@@ -1273,9 +1852,7 @@ public:
 	bool propose_independent(cChain& chn, rjMcMC1DModel& mpro)
 	{
 		const rjMcMC1DModel& mcur = chn.model;
-		const double& temperature = chn.temperature;
-		mpro = choosefromprior();
-		set_misfit(mpro);
+		mpro = choosefromprior(chn.random);
 
 		size_t npro = mpro.nlayers() - 1;
 		size_t ncur = mcur.nlayers() - 1;
@@ -1286,24 +1863,18 @@ public:
 		priorratio = 1.0;
 
 		double logpriorratio = std::log(priorratio);
-		double loglr = -(mpro.get_misfit() - mcur.get_misfit()) / 2.0 / temperature;
-		double logar = logpriorratio + loglr;
-		double logu = std::log(urand<double>());
-		if (logu < logar) {
-			return true;
-		}
-		return false;
+		return metropolis(chn, mpro, logpriorratio);
 	}
 
-	rjMcMC1DModel choosefromprior()	{
+	rjMcMC1DModel choosefromprior(cCounterRandomStream& rng)	{
 		rjMcMC1DModel m;
-		size_t nl = irand(nl_min, nl_max);
+		size_t nl = rng.irand(nl_min, nl_max);
 		m.initialise(pmax, vmin, vmax);
 		for (size_t li = 0; li < nl; li++) {
 			bool status = false;
 			while (status == false) {
-				double pos = urand(0.0, pmax);//position of interface
-				double value = urand(vmin, vmax);//value
+				double pos = rng.urand(0.0, pmax);//position of interface
+				double value = rng.urand(vmin, vmax);//value
 				status = m.insert_interface(pos, value);
 			}
 		}
@@ -1323,7 +1894,7 @@ public:
 			mnoise.max = noisemag_priorbounds[ni].second;
 			mnoise.data_bounds = noisemag_dbounds[ni];
 			//sample
-			mnoise.value = urand(mnoise.min, mnoise.max);
+			mnoise.value = rng.urand(mnoise.min, mnoise.max);
 			mnoise.sd_valuechange = noisemag_sd[ni];
 			m.mnoises.push_back(mnoise);
 
@@ -1351,11 +1922,233 @@ public:
 		pmap.resettozero();
 		nmap.resettozero();
 		mnmap.resettozero();
+		ensemble.initialise(EnsembleSize);
+		convergence.clear();
+		PPDCheckpoint.clear();
+		PPDCheckpointEntries = 0;
+		StopSampling = false;
+		nsamples_run = 0;
+
+		//One chain is at temperature 1 at each sample, so on average each chain holds an equal share of the map samples
+		const size_t nincluded = nsamples > nburnin ? (nsamples - nburnin - 1) / thinrate + 1 : 0;
+		const size_t nperchain = nchains() > 0 ? nincluded / nchains() + 1 : 0;
 		for (size_t ci = 0; ci < nchains(); ci++) {
 			chains[ci] = cChain();
 			chains[ci].swap_histogram.resize(nchains());
+			chains[ci].pmap = pmap;
+			chains[ci].nmap.reserve(nperchain);
+			chains[ci].mnmap.reserve(nperchain);
+			chains[ci].ensemble.initialise(EnsembleSize);
+			chains[ci].random.seed(RandomSeed, RecordKey, (uint64_t)ci + 1);
+		}
+		SwapRandom.seed(RandomSeed, RecordKey, 0);
+	}
+
+	void advance_chain(const size_t& si, const size_t& ci)
+	{
+		cChain& chn = chains[ci];//Current chain
+		rjMcMC1DModel& mcur = chn.model;//Current model on chain
+		chn.random.set_sample(si);
+
+		if (si == 0) {
+			//Initialise chain
+			mcur = choosefromprior(chn.random);
+			set_misfit(mcur);
+		}
+		else {
+			rjMcMC1DModel mpro = mcur;
+			size_t nopt = 4;
+			//adaptive based on whether noise or nuisance inversion
+			//is enabled.
+			if (mcur.nnoises() > 0) nopt += 1;
+			if (mcur.nnuisances() > 0) nopt += 1;
+
+			size_t option = chn.random.irand((size_t)0, nopt - 1);
+
+			bool accept = false;
+			switch (option) {
+			case 0: accept = propose_valuechange(chn,mpro); break;
+			case 1: accept = propose_move(chn,mpro); break;
+			case 2: accept = propose_birth(chn,mpro); break;
+			case 3: accept = propose_death(chn,mpro); break;
+			case 4: {
+				if (mcur.nnoises() > 0) {
+					accept = propose_noisechange(chn,mpro);
+				}
+				else {
+					accept = propose_nuisancechange(chn,mpro);
+				}
+				break;
+				}
+			case 5: accept = propose_nuisancechange(chn,mpro); break;
+			case 6: accept = propose_independent(chn,mpro); break;
+			default: glog.errormsg(_SRC_, "Proposal option %zu out of range\n", option);
+			}
+
+			// std::cout << &mcur << " " << &mpro << std::endl;
+			if (accept) {
+				mcur = mpro;
+			}
+		}
+
+		if (chn.temperature == 1.0) {
+			if (chn.hasbest == false) {
+				chn.highestlikelihood = mcur;
+				chn.lowestmisfit = mcur;
+				chn.hasbest = true;
+			}
+			else {
+				if (mcur.logppd() > chn.highestlikelihood.logppd()) {
+					chn.highestlikelihood = mcur;
+				}
+				//if (mcur.get_misfit() < LowestMisfit.get_misfit()) {
+				double cnmf  = standard_l2misfit(mcur);
+				double lnmf = standard_l2misfit(chn.lowestmisfit);
+				if (cnmf < lnmf) {
+					chn.lowestmisfit = mcur;
+				}
+			}
+
+			if (should_include_in_maps(si)) {
+				chn.pmap.addmodel(mcur);
+				chn.nmap.addmodel(mcur);
+				chn.mnmap.addmodel(mcur);
+				const double key = chn.random.urand();
+				if (chn.ensemble.offer(key, mcur.get_misfit())) {
+					cPackedModel pm;
+					pm.pack(mcur, pmax, vmin, vmax, false);
+					chn.ensemble.keep(key, std::move(pm));
+				}
+				if (ConvergenceInterval > 0) {
+					//Each chain holds a different slot so there is no contention
+					trace_misfit[chn.slot].push_back((float)mcur.get_misfit());
+					trace_nlayers[chn.slot].push_back((float)mcur.nlayers());
+				}
+			}
+			if (verbose) {
+				#pragma omp critical (rjmcmc_report)
+				print_report(si, ci, chn.temperature, mcur);
+			}
+		}
+
+		if (should_save_convergence_record(si)) {
+			if (KeepChainModels) {
+				cPackedModel pm;
+				pm.pack(mcur, pmax, vmin, vmax, true);
+				chn.history.models.push_back(std::move(pm));
+			}
+			chn.history.temperature.push_back((float)chn.temperature);
+			chn.history.sample.push_back((uint32_t)si);
+			chn.history.nlayers.push_back((uint32_t)mcur.nlayers());
+			chn.history.misfit.push_back((float)mcur.get_chi2());
+			chn.history.logppd.push_back((float)mcur.logppd());
+			chn.history.ar_valuechange.push_back(chn.pvaluechange.ar());
+			chn.history.ar_move.push_back(chn.pmove.ar());
+			chn.history.ar_birth.push_back(chn.pbirth.ar());
+			chn.history.ar_death.push_back(chn.pdeath.ar());
+			chn.history.ar_nuisancechange.push_back(chn.pnuisancechange.ar());					
+			if (mcur.nnoises() > 0) {
+				chn.history.ar_noisechange.push_back(chn.pnoisechange.ar());
+			}
+			if (DelayedAcceptance) {
+				chn.history.ar_screen.push_back(chn.pscreen.ar());
+			}
+		}
+	}
+
+	void swap_chains(const size_t& si)
+	{
+		//Parallel Tempering
+		SwapRandom.set_sample(si);
+		for (size_t i = nchains()-1; i >= 1; i--) {
+			const size_t j = SwapRandom.irand((size_t)0, i);
+			chains[i].swap_histogram[j]++;
+			if (i != j) {
+				if (propose_chain_swap(chains[i].temperature, chains[i].model, chains[j].temperature, chains[j].model, SwapRandom)) {
+					std::swap(chains[i].slot, chains[j].slot);
+				}
+			}
+		}
+	}
+
+	//Combines the temperature 1 samples of each chain in chain order, so results do not depend on the number of threads
+	void reduce_chains()
+	{
+		bool hasbest = false;
+		size_t nentries = 0;
+		for (size_t ci = 0; ci < nchains(); ci++) {
+			nentries += chains[ci].nmap.get_nentries();
 		}
+		nmap.reserve(nentries);
+		mnmap.reserve(nentries);
 
+		for (size_t ci = 0; ci < nchains(); ci++) {
+			cChain& chn = chains[ci];
+			pmap.addmap(chn.pmap);
+			nmap.addmap(chn.nmap);
+			mnmap.addmap(chn.mnmap);
+			ensemble.merge(chn.ensemble);
+
+			if (chn.hasbest == false) continue;
+			if (hasbest == false) {
+				HighestLikelihood = chn.highestlikelihood;
+				LowestMisfit = chn.lowestmisfit;
+				hasbest = true;
+			}
+			else {
+				if (chn.highestlikelihood.logppd() > HighestLikelihood.logppd()) {
+					HighestLikelihood = chn.highestlikelihood;
+				}
+				if (standard_l2misfit(chn.lowestmisfit) < standard_l2misfit(LowestMisfit)) {
+					LowestMisfit = chn.lowestmisfit;
+				}
+			}
+		}
+	}
+
+	bool should_check_convergence(const size_t& si) const
+	{
+		if (ConvergenceInterval == 0) return false;
+		if (si <= nburnin) return false;
+		return (si - nburnin) % ConvergenceInterval == 0;
+	}
+
+	//Called serially between samples, returns true once every threshold is met
+	bool check_convergence(const size_t& si)
+	{
+		std::vector<const std::vector<float>*> tm;
+		std::vector<const std::vector<float>*> tn;
+		double ess = 0.0;
+		for (size_t k = 0; k < trace_misfit.size(); k++) {
+			if (trace_misfit[k].empty()) continue;//not a temperature 1 slot
+			tm.push_back(&trace_misfit[k]);
+			tn.push_back(&trace_nlayers[k]);
+			ess += std::min(cConvergenceDiagnostics::ess(trace_misfit[k]), cConvergenceDiagnostics::ess(trace_nlayers[k]));
+		}
+		const double rm = cConvergenceDiagnostics::rhat(tm);
+		const double rn = cConvergenceDiagnostics::rhat(tn);
+
+		std::vector<uint32_t> counts(pmap.counts.size(), 0);
+		size_t entries = 0;
+		for (size_t ci = 0; ci < nchains(); ci++) {
+			const rjMcMC1DPPDMap& m = chains[ci].pmap;
+			for (size_t i = 0; i < counts.size(); i++) counts[i] += m.counts[i];
+			entries += m.get_nentries();
+		}
+		const double change = cConvergenceDiagnostics::ppd_change(counts, entries, PPDCheckpoint, PPDCheckpointEntries, pmap.nvbins());
+		PPDCheckpoint = std::move(counts);
+		PPDCheckpointEntries = entries;
+
+		convergence.sample.push_back((uint32_t)si);
+		convergence.rhat_misfit.push_back((float)std::min(rm, (double)FLT_MAX));
+		convergence.rhat_nlayers.push_back((float)std::min(rn, (double)FLT_MAX));
+		convergence.ess.push_back((float)ess);
+		convergence.ppd_change.push_back((float)change);
+
+		if (rm > RhatThreshold || rn > RhatThreshold) return false;
+		if (ess < MinimumESS) return false;
+		if (change > PPDChangeThreshold) return false;
+		return true;
 	}
 
 	void sample()
@@ -1371,118 +2164,46 @@ public:
 		std::vector<double> ladder = get_temperature_ladder();
 		for (size_t ci = 0; ci < nchains(); ci++) {
 			chains[ci].temperature = ladder[ci];
+			chains[ci].slot = ci;
 		}
+		trace_misfit.assign(nchains(), std::vector<float>());
+		trace_nlayers.assign(nchains(), std::vector<float>());
 
+		//Chains only interact at the swap step, so between swaps each thread advances whole chains
+		const int nthreads = (int)std::min(ChainThreads, nchains());
+		const int nc = (int)nchains();
+		InChainRegion = nthreads > 1;
+		#pragma omp parallel num_threads(nthreads) if(nthreads > 1)
 		for (size_t si = 0; si < nsamples; si++) {
-			for (size_t ci = 0; ci < nchains(); ci++) {
-				cChain& chn = chains[ci];//Current chain
-				rjMcMC1DModel& mcur = chn.model;//Current model on chain
-
-				if (si == 0) {
-					//Initialise chain
-					mcur = choosefromprior();
-					set_misfit(mcur);
-				}
-				else {
-					rjMcMC1DModel mpro = mcur;
-					size_t nopt = 4;
-					//adaptive based on whether noise or nuisance inversion
-					//is enabled.
-					if (mcur.nnoises() > 0) nopt += 1;
-					if (mcur.nnuisances() > 0) nopt += 1;
-
-					size_t option = irand((size_t)0, nopt - 1);
-
-					bool accept = false;
-					switch (option) {
-					case 0: accept = propose_valuechange(chn,mpro); break;
-					case 1: accept = propose_move(chn,mpro); break;
-					case 2: accept = propose_birth(chn,mpro); break;
-					case 3: accept = propose_death(chn,mpro); break;
-					case 4: {
-						if (mcur.nnoises() > 0) {
-							accept = propose_noisechange(chn,mpro);
-						}
-						else {
-							accept = propose_nuisancechange(chn,mpro);
-						}
-						break;
-						}
-					case 5: accept = propose_nuisancechange(chn,mpro); break;
-					case 6: accept = propose_independent(chn,mpro); break;
-					default: glog.errormsg(_SRC_, "Proposal option %zu out of range\n", option);
-					}
-
-					// std::cout << &mcur << " " << &mpro << std::endl;
-					if (accept) {
-						mcur = mpro;
-					}
-				}
-
-				if (chn.temperature == 1.0) {
-					if(ci == 0 && si == 0){
-						HighestLikelihood = mcur;
-						LowestMisfit = mcur;
-					}
-					else {
-						if (mcur.logppd() > HighestLikelihood.logppd()) {
-							HighestLikelihood = mcur;
-						}
-						//if (mcur.get_misfit() < LowestMisfit.get_misfit()) {
-						double cnmf  = standard_l2misfit(mcur);
-						double lnmf = standard_l2misfit(LowestMisfit);
-						if (cnmf < lnmf) {
-							LowestMisfit = mcur;
-						}
-					}
-
-					if (should_include_in_maps(si)) {
-						pmap.addmodel(mcur);
-						nmap.addmodel(mcur);
-						mnmap.addmodel(mcur);
-						ensemble.push_back(mcur);
-					}
-					if (verbose) {
-						print_report(si, ci, chn.temperature, mcur);
-					}
-				}
-
-				if (should_save_convergence_record(si)) {
-					chn.history.models.push_back(mcur);
-					chn.history.temperature.push_back((float)chn.temperature);
-					chn.history.sample.push_back((uint32_t)si);
-					chn.history.nlayers.push_back((uint32_t)mcur.nlayers());
-					chn.history.misfit.push_back((float)mcur.get_chi2());
-					chn.history.logppd.push_back((float)mcur.logppd());
-					chn.history.ar_valuechange.push_back(chn.pvaluechange.ar());
-					chn.history.ar_move.push_back(chn.pmove.ar());
-					chn.history.ar_birth.push_back(chn.pbirth.ar());
-					chn.history.ar_death.push_back(chn.pdeath.ar());
-					chn.history.ar_nuisancechange.push_back(chn.pnuisancechange.ar());					
-					if (mcur.nnoises() > 0) {
-						chn.history.ar_noisechange.push_back(chn.pnoisechange.ar());
-					}
-				}				
+			#pragma omp for schedule(dynamic,1)
+			for (int ci = 0; ci < nc; ci++) {
+				advance_chain(si, (size_t)ci);
 			}
 
-			//Parallel Tempering
-			for (size_t i = nchains()-1; i >= 1; i--) {
-				const size_t j = irand<size_t>(0,i);
-				chains[i].swap_histogram[j]++;
-				if (i != j) {
-					propose_chain_swap(chains[i].temperature, chains[i].model, chains[j].temperature, chains[j].model);
+			#pragma omp single
+			{
+				swap_chains(si);
+				stream_history();
+				nsamples_run = si + 1;
+				if (should_check_convergence(si) && check_convergence(si)) {
+					StopSampling = StopWhenConverged;
 				}
 			}
+			//Every thread sees the same flag after the barrier ending the single block
+			if (StopSampling) break;
 		}
+		InChainRegion = false;
+		reduce_chains();
+
 		double t2 = gettime();
 		endtime = timestamp();
 		samplingtime = t2 - t1;
 	}
 
-	static bool propose_chain_swap(double& Ti, rjMcMC1DModel& Mi, double& Tj, rjMcMC1DModel& Mj) {
+	static bool propose_chain_swap(double& Ti, rjMcMC1DModel& Mi, double& Tj, rjMcMC1DModel& Mj, cCounterRandomStream& rng) {
 		//double ar = std::exp((1.0 / Ti - 1.0 / Tj) * (Phii - Phij));
 		double logar = (1.0 / Ti - 1.0 / Tj) * (Mi.get_misfit() - Mj.get_misfit());
-		double logu  = std::log(urand<double>());
+		double logu  = std::log(rng.urand());
 		if (logu < logar) {
 			std::swap(Ti, Tj);
 			//std::swap(Mi, Mj);
@@ -1546,6 +2267,7 @@ public:
 		a = nc.putAtt("nlayers_max", NcType::nc_UINT, (unsigned int) nl_max);
 
 		a = nc.putAtt("nsamples", NcType::nc_UINT, (unsigned int) nsamples);
+		a = nc.putAtt("nsamples_run", NcType::nc_UINT, (unsigned int) nsamples_run);
 		a = nc.putAtt("nchains", NcType::nc_UINT, (unsigned int) nchains());
 		a = nc.putAtt("nburnin", NcType::nc_UINT, (unsigned int) nburnin);
 		a = nc.putAtt("thinrate", NcType::nc_UINT, (unsigned int) thinrate);
@@ -1556,7 +2278,9 @@ public:
 
 
 		NcVar var;
-		NcDim data_dim = nc.addDim("data", ndata);
+		//The chain model dimensions already exist when the models were streamed during sampling
+		const bool streamed = (StreamFile == &nc);
+		NcDim data_dim = get_or_add_dim(nc, "data", ndata);
 		var = nc.addVar("observations", NcType::nc_DOUBLE, data_dim);
 		var.putVar(obs.data());
 
@@ -1571,7 +2295,7 @@ public:
 		var = nc.addVar("value", NcType::nc_DOUBLE, nv_dim);
 		var.putVar(pmap.vbin.data());
 
-		NcDim nl_dim = nc.addDim("layer", pmap.layercounts.size());
+		NcDim nl_dim = get_or_add_dim(nc, "layer", pmap.layercounts.size());
 		var = nc.addVar("layer", NcType::nc_UINT, nl_dim);
 		std::vector<unsigned int> lbin = increment(pmap.layercounts.size(), 1U, 1U);
 		var.putVar(lbin.data());
@@ -1593,14 +2317,14 @@ public:
 		//a = nc.putAtt("ar_nuisancechange", NcType::nc_FLOAT, pnuisancechange.ar() );
 
 		//Convergence Records
-		NcDim chain_dim = nc.addDim("chain", nchains());
+		NcDim chain_dim = get_or_add_dim(nc, "chain", nchains());
 		var = nc.addVar("chain", NcType::nc_UINT, chain_dim);
 		var.putVar(chains[0].history.sample.data());
 
 		size_t ncvs = chains[0].history.sample.size();//Number of samples in the convergence record
-		NcDim cvs_dim = nc.addDim("convergence_sample", ncvs);
+		NcDim cvs_dim = get_or_add_dim(nc, "convergence_sample", ncvs);
 		var = nc.addVar("convergence_sample", NcType::nc_UINT, cvs_dim);
-		var.putVar(chains[0].history.sample.data());
+		var.putVar(std::vector<size_t>{ 0 }, std::vector<size_t>{ ncvs }, chains[0].history.sample.data());
 
 		std::vector<unsigned int> chn = increment(nchains(), 1U, 1U);
 		std::vector<NcDim> dims    = { chain_dim, cvs_dim };
@@ -1622,17 +2346,33 @@ public:
 			if (chn.model.nnoises() > 0) {
 				write_chain_variable(ci, chn.history.ar_noisechange, "ar_noisechange", NcType::nc_FLOAT, nc, dims);
 			}
+			if (DelayedAcceptance) {
+				write_chain_variable(ci, chn.history.ar_screen, "ar_screen", NcType::nc_FLOAT, nc, dims);
+			}
 			write_chain_variable(ci, chn.swap_histogram, "swap_histogram", NcType::nc_UINT, nc, dchnchn);
 
 			//bookmark
-			if (savechains){
+			if (savechains && streamed == false){
 				std::vector<NcDim> dims_predicted = { chain_dim, cvs_dim, data_dim };
 				std::vector<NcDim> dims_partition = { chain_dim, cvs_dim, nl_dim };
-				write_chain_partitions(nc, ci, chn.history.models, dims_partition);
-				write_chain_predicted(nc, ci, chn.history.models, dims_predicted);
+				write_chain_models(nc, ci, chn.history.models, dims_partition, dims_predicted);
 			}
 		}
 
+		if (convergence.sample.size() > 0) {
+			NcDim check_dim = nc.addDim("convergence_check", convergence.sample.size());
+			var = nc.addVar("convergence_check", NcType::nc_UINT, check_dim);
+			var.putVar(convergence.sample.data());
+			var = nc.addVar("rhat_misfit", NcType::nc_FLOAT, check_dim);
+			var.putVar(convergence.rhat_misfit.data());
+			var = nc.addVar("rhat_nlayers", NcType::nc_FLOAT, check_dim);
+			var.putVar(convergence.rhat_nlayers.data());
+			var = nc.addVar("ess", NcType::nc_FLOAT, check_dim);
+			var.putVar(convergence.ess.data());
+			var = nc.addVar("ppd_change", NcType::nc_FLOAT, check_dim);
+			var.putVar(convergence.ppd_change.data());
+		}
+
 		rjMcMC1DPPDMap::cSummaryModels s = pmap.get_summary_models();
 		var = nc.addVar("mean_model", NcType::nc_FLOAT, np_dim);
 		var.putVar(s.mean.data());
@@ -1727,69 +2467,81 @@ public:
 		var.putVar(startp, countp, data.data());
 	}
 
-	void write_chain_partitions(NcFile& nc, const size_t& ci, const std::vector<rjMcMC1DModel>& models, std::vector<NcDim> dims)
+	void put_chain_model(const size_t& ci, const size_t& mi, const cPackedModel& m, NcVar& ptop_var, NcVar& val_var, NcVar& pred_var)
 	{
-		//bookmark		
-		const std::string ptop_name = "layer_depth_top";
-		const std::string val_name = "layer_value";
-
-		NcType nctype = NC_FLOAT;
-		NcVar ptop_var,val_var;
-		if (ci == 0) {
-			ptop_var = nc.addVar(ptop_name, nctype, dims);
-			val_var = nc.addVar(val_name, nctype, dims);
-		}
-		else {
-			ptop_var = nc.getVar(ptop_name);
-			val_var = nc.getVar(val_name);
+		std::vector<float> ptop(nl_max, NC_FILL_FLOAT);
+		std::vector<float> value(nl_max, NC_FILL_FLOAT);
+		for (size_t li = 0; li < m.nlayers(); li++) {
+			ptop[li]  = (float)cPackedModel::dequantise(m.ptop[li], 0.0, pmax);
+			value[li] = (float)cPackedModel::dequantise(m.value[li], vmin, vmax);
 		}
 
-		std::vector<float> ptop(nl_max);
-		std::vector<float> value(nl_max);
-		
+		std::vector<size_t> startp = { ci, mi, 0 };
+		std::vector<size_t> countp = { 1, 1, nl_max };
+		ptop_var.putVar(startp, countp, ptop.data());
+		val_var.putVar(startp, countp, value.data());
 
-		std::vector<size_t> startp = { ci, 0, 0 };
-		std::vector<size_t> countp = { 1, 1, nl_max};
-		for (size_t mi = 0; mi < models.size(); mi++) {
-			const rjMcMC1DModel& m = models[mi];
-			for (size_t li = 0; li < m.layers.size(); li++) {
-				ptop[li]  = (float)m.layers[li].ptop;
-				value[li] = (float)m.layers[li].value;
-			}
-			for (size_t li = m.layers.size(); li < nl_max; li++) {
-				ptop[li]  = NC_FILL_FLOAT;
-				value[li] = NC_FILL_FLOAT;
-			}
+		countp[2] = m.predicted.size();
+		pred_var.putVar(startp, countp, m.predicted.data());
+	}
 
-			startp[1] = mi;
-			ptop_var.putVar(startp, countp, ptop.data());
-			val_var.putVar(startp, countp, value.data());
-		}
+	NcVar get_or_add_var(NcFile& nc, const size_t& ci, const std::string& name, const NcType& nctype, const std::vector<NcDim>& dims)
+	{
+		if (ci == 0) return nc.addVar(name, nctype, dims);
+		return nc.getVar(name);
 	}
 
-	void write_chain_predicted(NcFile& nc, const size_t& ci, const std::vector<rjMcMC1DModel>& models, std::vector<NcDim> dims)
+	void write_chain_models(NcFile& nc, const size_t& ci, const std::vector<cPackedModel>& models, const std::vector<NcDim>& dims_partition, const std::vector<NcDim>& dims_predicted)
 	{
-		//bookmark		
-		const std::string name = "predicted";
-		NcType nctype = NC_FLOAT;		
-		
-		
-		NcVar var;
-		if (ci == 0) {
-			var = nc.addVar(name, nctype, dims);
-		}
-		else {
-			var = nc.getVar(name);
-		}
-		
-		std::vector<size_t> startp = { ci, 0, 0 };
-		std::vector<size_t> countp = { 1, 1, models[0].get_predicted().size() };
+		NcVar ptop_var = get_or_add_var(nc, ci, "layer_depth_top", NC_FLOAT, dims_partition);
+		NcVar val_var = get_or_add_var(nc, ci, "layer_value", NC_FLOAT, dims_partition);
+		NcVar pred_var = get_or_add_var(nc, ci, "predicted", NC_FLOAT, dims_predicted);
 		for (size_t mi = 0; mi < models.size(); mi++) {
-			startp[1] = mi;			
-			var.putVar(startp, countp, models[mi].get_predicted().data());
+			put_chain_model(ci, mi, models[mi], ptop_var, val_var, pred_var);
 		}
 	}
 
+	static NcDim get_or_add_dim(NcFile& nc, const std::string& name, const size_t& size)
+	{
+		NcDim d = nc.getDim(name);
+		if (d.isNull()) d = nc.addDim(name, size);
+		return d;
+	}
+
+	//Creates the chain model variables in the maps file before sampling so models are written as they are produced
+	void begin_history_stream(NcFile& nc)
+	{
+		NcDim chain_dim = nc.addDim("chain", nchains());
+		NcDim cvs_dim = nc.addDim("convergence_sample");//unlimited
+		NcDim nl_dim = nc.addDim("layer", pmap.layercounts.size());
+		NcDim data_dim = nc.addDim("data", ndata);
+		const std::vector<NcDim> dims_partition = { chain_dim, cvs_dim, nl_dim };
+		const std::vector<NcDim> dims_predicted = { chain_dim, cvs_dim, data_dim };
+		StreamFile = &nc;
+		StreamPTop = nc.addVar("layer_depth_top", NC_FLOAT, dims_partition);
+		StreamValue = nc.addVar("layer_value", NC_FLOAT, dims_partition);
+		StreamPredicted = nc.addVar("predicted", NC_FLOAT, dims_predicted);
+	}
+
+	//Writes and releases the chain models produced since the last call, called serially between samples
+	void stream_history()
+	{
+		if (StreamFile == nullptr) return;
+		for (size_t ci = 0; ci < nchains(); ci++) {
+			cChainHistory& h = chains[ci].history;
+			for (size_t k = 0; k < h.models.size(); k++) {
+				put_chain_model(ci, h.nstreamed, h.models[k], StreamPTop, StreamValue, StreamPredicted);
+				h.nstreamed++;
+			}
+			h.models.clear();
+		}
+	}
+
+	void end_history_stream()
+	{
+		StreamFile = nullptr;
+	}
+
 };
 
 
@@ -13,6 +13,7 @@ Richard L. Taylor, Geoscience Australia.
 
 //standard library headers
 #include <memory>
+#include <set>
 
 //custom headers
 #include "gaaem_version.h"
@@ -21,10 +22,14 @@ Richard L. Taylor, Geoscience Australia.
 #include "tdemsystem.h"
 #include "file_formats.h"
 #include "rjmcmc1d.h"
+#include "completionjournal.h"
+#include "mappedrecordfile.h"
+#include "recordqueue.h"
 
 class cTDEmSystemInfo{
 
 public:
+	std::string SystemFile;
 	cTDEmSystem T;
 	size_t ncomps;
 	size_t nwindows;
@@ -127,6 +132,8 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 
 	size_t nsystems;
 	std::vector<cTDEmSystemInfo> SV;
+	std::vector<std::vector<std::unique_ptr<cTDEmSystem>>> ChainSystems;//[engine-1][system] extra forward model engines for concurrent chains
+	std::vector<std::vector<std::unique_ptr<cTDEmSystem>>> SurrogateSystems;//[engine][system] coarse forward model engines for delayed acceptance
 	std::vector<TDEMNuisance> ntemplate;
 	std::vector<std::string> ninitial;
 	cTDEmGeometry  IG;
@@ -135,18 +142,25 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 	bool SaveMaps;
 	int  SaveMapsRate;
 	bool SaveChains;
+	bool StreamChainHistory = false;
 	
 	cBlock Control;
 	std::string LogFile;
 	double memoryusedatstart;
 
 	std::string InputDataFile;
-	FILE*  fp_indata;
+	cMappedRecordFile InputRecords;
+	bool DynamicRecords = false;
+	std::unique_ptr<cRecordQueue> RecordQueue;
+	size_t NextBlock = 0;//next static block for this process
+	std::set<size_t> CompletedElsewhere;//records journaled by other processes of a previous run
 
 	size_t Outputcolumn; //output column number
 	std::string OutputDirectory;
 	std::string OutputDataFile;
 	std::string MapsDirectory;
+	bool Resume = false;
+	cCompletionJournal Journal;
 	
 	size_t HeaderLines;
 	size_t SubSample;
@@ -186,7 +200,7 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 
 	~rjmcmc1dTDEmInverter()
 	{
-		fclose(fp_indata);
+		RecordQueue.reset();
 		glog.close();
 	}
 
@@ -227,6 +241,9 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 		SaveMapsRate = SB.getintvalue("SaveMapsRate");
 		if (SaveMapsRate == INT_MIN)SaveMapsRate = 1;
 		SaveChains = SB.getboolvalue("SaveChains");
+		if (SB.getvalue("StreamChainHistory", StreamChainHistory) == false) {
+			StreamChainHistory = false;
+		}
 		
 		cBlock IB = Control.findblock("Input");
 		HeaderLines = (size_t)IB.getintvalue("HeaderLines");
@@ -239,12 +256,38 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 
 		InputDataFile = IB.getstringvalue("DataFile");
 		fixseparator(InputDataFile);
-		fp_indata = fileopen(InputDataFile, "r");
+		if (InputRecords.open(InputDataFile) == false) {
+			glog.errormsg(_SRC_, "Could not open InputDataFile %s\n", InputDataFile.c_str());
+		}
+		if (IB.getvalue("DynamicRecords", DynamicRecords) == false) {
+			DynamicRecords = false;
+		}
+		if (DynamicRecords && mpiRank == 0 && mpiSize > 1) {
+			glog.logmsg(0, "DynamicRecords relies on asynchronous MPI progress for one sided operations, otherwise requests wait on rank 0\n");
+		}
+		NextBlock = mpiRank;
 
 		s = OutputDirectory + OB.getstringvalue("DataFile");
 		fixseparator(s);
 		OutputDataFile = insert_after_filename(s, rankstr);
 
+		Resume = false;
+		OB.getvalue("Resume", Resume);
+		sFilePathParts jfpp = getfilepathparts(OutputDataFile);
+		Journal.open(jfpp.directory + jfpp.prefix + ".journal", Resume);
+		if (Resume && exists(OutputDataFile)) {
+			//Discard any partially written record after the last journaled one
+			const int64_t n = std::max(Journal.resume_offset(), (int64_t)0);
+			glog.logmsg(0, "Resuming OutputDataFile %s at byte %ld\n", OutputDataFile.c_str(), (long)n);
+			std::filesystem::resize_file(OutputDataFile, (std::uintmax_t)n);
+		}
+
+		if (DynamicRecords) {
+			RecordQueue = std::make_unique<cRecordQueue>();
+			//A record may be taken by a different process than in the previous run
+			if (Resume) load_other_journals(s);
+		}
+
 		if (SaveMaps) {
 			MapsDirectory = OB.getstringvalue("MapsDirectory");
 			addtrailingseparator(MapsDirectory);
@@ -273,6 +316,7 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 			std::string stmfile = b.getstringvalue("SystemFile");
 			glog.logmsg(0, "Reading system file %s\n", stmfile.c_str());
 			T.readsystemdescriptorfile(stmfile);
+			S.SystemFile = stmfile;
 
 			glog.log("==============System file %s\n", stmfile.c_str());
 			glog.log(T.STM.get_as_string());
@@ -411,6 +455,91 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 			temperature_high = 2.5;
 		}
 
+		if (b.getvalue("EnsembleSize", EnsembleSize) == false) {
+			EnsembleSize = 1000;
+		}
+
+		if (b.getvalue("ConvergenceInterval", ConvergenceInterval) == false) {
+			ConvergenceInterval = 0;
+		}
+		if (b.getvalue("StopWhenConverged", StopWhenConverged) == false) {
+			StopWhenConverged = false;
+		}
+		if (b.getvalue("RhatThreshold", RhatThreshold) == false) {
+			RhatThreshold = 1.05;
+		}
+		if (b.getvalue("MinimumESS", MinimumESS) == false) {
+			MinimumESS = 200.0;
+		}
+		if (b.getvalue("PPDChangeThreshold", PPDChangeThreshold) == false) {
+			PPDChangeThreshold = 0.02;
+		}
+		if (StopWhenConverged && ConvergenceInterval == 0) {
+			glog.warningmsg(_SRC_, "StopWhenConverged has no effect unless ConvergenceInterval is set\n");
+		}
+
+		if (b.getvalue("RandomSeed", RandomSeed) == false) {
+			RandomSeed = 0;
+		}
+
+		if (b.getvalue("ChainThreads", ChainThreads) == false) {
+			ChainThreads = 1;
+		}
+		if (ChainThreads < 1) ChainThreads = 1;
+		if (ChainThreads > nc) ChainThreads = nc;
+#if !defined _OPENMP
+		ChainThreads = 1;
+#endif
+		glog.logmsg(0, "Advancing %zu chains on %zu threads\n", nc, ChainThreads);
+
+		//Each concurrent chain thread other than the first needs its own forward model engines
+		ChainSystems.resize(ChainThreads - 1);
+		for (size_t k = 0; k < ChainSystems.size(); k++) {
+			ChainSystems[k].resize(nsystems);
+			for (size_t i = 0; i < nsystems; i++) {
+				ChainSystems[k][i] = std::make_unique<cTDEmSystem>();
+				ChainSystems[k][i]->readsystemdescriptorfile(SV[i].SystemFile);
+			}
+		}
+
+		if (b.getvalue("MultipleTryCandidates", MultipleTryCandidates) == false) {
+			MultipleTryCandidates = 1;
+		}
+		if (MultipleTryCandidates < 1) MultipleTryCandidates = 1;
+		if (MultipleTryCandidates > 1) {
+			glog.logmsg(0, "Multiple-try Metropolis with %zu candidates for value change and move proposals\n", MultipleTryCandidates);
+		}
+
+		if (b.getvalue("DelayedAcceptance", DelayedAcceptance) == false) {
+			DelayedAcceptance = false;
+		}
+		if (DelayedAcceptance) {
+			//The surrogate is the same system with a coarser frequency and Hankel transform discretisation
+			size_t fpd, nabs;
+			if (b.getvalue("SurrogateFrequenciesPerDecade", fpd) == false) {
+				fpd = 3;
+			}
+			if (b.getvalue("SurrogateNumberOfAbscissa", nabs) == false) {
+				nabs = 11;
+			}
+			if (fpd < 1) fpd = 1;
+			if (nabs < 3) nabs = 3;
+			glog.logmsg(0, "Delayed acceptance with a surrogate of %zu frequencies per decade and %zu abscissa\n", fpd, nabs);
+
+			SurrogateSystems.resize(ChainThreads);
+			for (size_t k = 0; k < SurrogateSystems.size(); k++) {
+				SurrogateSystems[k].resize(nsystems);
+				for (size_t i = 0; i < nsystems; i++) {
+					std::unique_ptr<cTDEmSystem> T = std::make_unique<cTDEmSystem>();
+					T->readsystemdescriptorfile(SV[i].SystemFile);
+					T->FrequenciesPerDecade = fpd;
+					T->LEM.NumAbscissa = nabs;
+					T->systeminitialise();
+					SurrogateSystems[k][i] = std::move(T);
+				}
+			}
+		}
+
 		for (size_t i = 0; i < TDEMNuisance::number_of_types(); i++) {
 			std::string str = strprint("Nuisance%lu", i + 1);
 			cBlock c = b.findblock(str);
@@ -451,34 +580,50 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 
 	}
 
-	bool readnextrecord()
+	void load_other_journals(const std::string& outputdatafile)
 	{
-		if (filegetline(fp_indata, CurrentRecordString) == false) {
-			return false;
-		}
-		else {
-			CurrentRecord++;
-			if (CurrentRecord > LastRecord + HeaderLines) {
-				return false;
-			}
-			else {
-				return true;
+		//Journals of every process of the previous run, which may have had a different number of processes
+		for (size_t k = 0; ; k++) {
+			if (k == mpiRank) continue;
+			sFilePathParts fpp = getfilepathparts(insert_after_filename(outputdatafile, stringvalue(k, ".%04lu")));
+			cCompletionJournal J;
+			if (J.read(fpp.directory + fpp.prefix + ".journal") == false) {
+				if (k >= mpiSize) break;
+				continue;
 			}
+			for (const auto& e : J.entries()) CompletedElsewhere.insert(e.first);
 		}
+		glog.logmsg(0, "Other processes had completed %zu records\n", CompletedElsewhere.size());
+	}
+
+	//Positions at the b'th subsampled record, going straight to it through the byte offset index
+	bool readrecord(const size_t& b)
+	{
+		CurrentRecord = HeaderLines + FirstRecord + b * SubSample;
+		if (CurrentRecord > LastRecord + HeaderLines) return false;
+		if (CurrentRecord > InputRecords.nrecords()) return false;
+		CurrentRecordString = std::string(InputRecords.record(CurrentRecord - 1));
+		return true;
 	}
 
 	bool readnextrecord_thisprocess()
 	{
-		//Skip to next record for this process
-		while (readnextrecord()) {
-			int  r = ((int)CurrentRecord - (int)HeaderLines - (int)FirstRecord);
-			if (r < 0)continue;
-			size_t n = (size_t)r % SubSample;
-			size_t b = (size_t)floor((double)r / (double)SubSample);
-			size_t p = b % mpiSize;
-			if (n == 0 && p == mpiRank)return true;
+		//Dynamically each process takes the next unclaimed record when it is free,
+		//otherwise every mpiSize'th record from this process's rank
+		while (true) {
+			size_t b;
+			if (DynamicRecords) {
+				b = (size_t)RecordQueue->next();
+			}
+			else {
+				b = NextBlock;
+				NextBlock += mpiSize;
+			}
+			if (readrecord(b) == false) return false;
+			if (Journal.completed(CurrentRecord)) continue;
+			if (CompletedElsewhere.count(CurrentRecord) > 0) continue;
+			return true;
 		}
-		return false;
 	}
 
 	void parsecurrentrecord()
@@ -722,7 +867,16 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 
 	void sample()
 	{
+		RecordKey = CurrentRecord;
+		KeepChainModels = SaveChains && maps_due();
 		rjMcMC1DSampler::reset();
+
+		//Chain models go to the maps file as they are produced rather than being held until the end
+		std::unique_ptr<NcFile> streamfile;
+		if (KeepChainModels && StreamChainHistory) {
+			streamfile = std::make_unique<NcFile>(maps_ncfile(), NcFile::FileMode::replace);
+			begin_history_stream(*streamfile);
+		}
 		rjMcMC1DSampler::sample();
 		std::string dstr = results_string();
 
@@ -739,13 +893,17 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 		//Output data record
 		FILE* fp = fileopen(OutputDataFile, "a");
 		fprintf(fp, dstr.c_str());
+		const int64_t offset = (int64_t)ftell(fp);
 		fclose(fp);
 
-		write_maps_to_file_netcdf();
+		write_maps_to_file_netcdf(streamfile.get());
+		end_history_stream();
 		
 		write_noise_maps();
 		write_nuisance_maps();
 
+		Journal.record(CurrentRecord, "ok", offset);
+
 	}
 
 	std::string results_string()
@@ -767,13 +925,7 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 		}
 		double misfit_lowest = LowestMisfit.get_misfit() / double(ndata);
 
-		size_t n = 0;
-		double sum = 0.0;
-		for (size_t mi = 0; mi < ensemble.size(); mi++) {
-			sum += ensemble[mi].get_misfit();
-			n++;
-		}
-		double misfit_average = sum / double(n) / double(ndata);
+		double misfit_average = ensemble.misfit_mean() / double(ndata);
 		
 		std::string buf;
 		//Id
@@ -840,6 +992,29 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 		OI.setdescription("Average misfit over all chains");
 		buf += strprint("%15.6le", misfit_average);
 
+		if (ConvergenceInterval > 0) {
+			const bool checked = convergence.sample.size() > 0;
+			OI.addfield("nsamples_run", 'I', 9, 0);
+			OI.setdescription("Number of samples per chain actually run, less than nsamples if sampling stopped at convergence");
+			buf += strprint("%9lu", nsamples_run);
+
+			OI.addfield("rhat_misfit", 'E', 15, 6);
+			OI.setdescription("Split R-hat of the misfit at the last convergence check");
+			buf += strprint("%15.6le", checked ? convergence.rhat_misfit.back() : -1.0);
+
+			OI.addfield("rhat_nlayers", 'E', 15, 6);
+			OI.setdescription("Split R-hat of the number of layers at the last convergence check");
+			buf += strprint("%15.6le", checked ? convergence.rhat_nlayers.back() : -1.0);
+
+			OI.addfield("ess", 'F', 10, 1);
+			OI.setdescription("Effective sample size of the temperature 1 samples at the last convergence check");
+			buf += strprint("%10.1lf", checked ? convergence.ess.back() : 0.0);
+
+			OI.addfield("ppd_change", 'F', 8, 4);
+			OI.setdescription("Largest change in a depth cell's conductivity histogram since the previous convergence check");
+			buf += strprint("%8.4lf", checked ? convergence.ppd_change.back() : 1.0);
+		}
+
 		OI.addfield("ndepthcells", 'I', 4, 0);
 		OI.setdescription("Number of depth cells or bins in histograms");
 		buf += strprint("%4lu", ndepthcells);
@@ -909,7 +1084,7 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 
 		size_t nn = nnuisances();
 		for (size_t j = 0; j < nn; j++) {
-			std::string nstr = ensemble[0].nuisances[j]->typestring();
+			std::string nstr = nmap.get_types()[j];
 			cStats<double> s(nmap.nuisance[j]);
 
 			std::string hs;
@@ -935,16 +1110,28 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 		return s;
 	}
 
-	void write_maps_to_file_netcdf()
+	bool maps_due()
 	{
-		if (SaveMaps == false)return;
-		if ((CurrentRecord - HeaderLines - FirstRecord) / SubSample % SaveMapsRate != 0)return;
+		if (SaveMaps == false)return false;
+		if ((CurrentRecord - HeaderLines - FirstRecord) / SubSample % SaveMapsRate != 0)return false;
+		return true;
+	}
 
-		std::string fileprefix = prefixstring();
-		std::string fname = MapsDirectory + fileprefix + ".pmap";
-		std::string ncfilepath = MapsDirectory + fileprefix + ".nc";
+	std::string maps_ncfile()
+	{
+		return MapsDirectory + prefixstring() + ".nc";
+	}
+
+	void write_maps_to_file_netcdf(NcFile* streamfile = nullptr)
+	{
+		if (maps_due() == false)return;
 
-		NcFile nc(ncfilepath, NcFile::FileMode::replace);
+		std::unique_ptr<NcFile> ncfile;
+		if (streamfile == nullptr) {
+			ncfile = std::make_unique<NcFile>(maps_ncfile(), NcFile::FileMode::replace);
+			streamfile = ncfile.get();
+		}
+		NcFile& nc = *streamfile;
 		NcGroupAtt a;
 		a = nc.putAtt("survey", NcType::nc_DOUBLE, (double) surveynumber);
 		a = nc.putAtt("date", NcType::nc_DOUBLE, (double) datenumber);
@@ -1061,32 +1248,66 @@ class rjmcmc1dTDEmInverter : public rjMcMC1DSampler{
 
 	std::vector<double> forwardmodel(const rjMcMC1DModel& m)
 	{
-		std::vector<double> c = m.getvalues();
-		if (param_value.islog10()){
-			pow10_apply(c);
+		return compute_forward(m, false);
+	}
+
+	std::vector<double> forwardmodel_surrogate(const rjMcMC1DModel& m)
+	{
+		return compute_forward(m, true);
+	}
+
+	std::vector<std::vector<double>> forwardmodel_batch(const std::vector<const rjMcMC1DModel*>& models)
+	{
+		return compute_forward(models, false);
+	}
+
+	std::vector<double> compute_forward(const rjMcMC1DModel& m, const bool surrogate)
+	{
+		return compute_forward(std::vector<const rjMcMC1DModel*>{ &m }, surrogate)[0];
+	}
+
+	static bool same_nuisances(const rjMcMC1DModel& a, const rjMcMC1DModel& b)
+	{
+		if (a.nnuisances() != b.nnuisances()) return false;
+		for (size_t i = 0; i < a.nnuisances(); i++) {
+			if (a.nuisances[i]->value != b.nuisances[i]->value) return false;
 		}
+		return true;
+	}
 
-		std::vector<double> t = m.getthicknesses();
-		cTDEmGeometry  G = getgeometry(m);
-		std::vector<double> pred(ndata);
+	//Consecutive models with the same nuisances share the geometry and primary field setup of each system
+	std::vector<std::vector<double>> compute_forward(const std::vector<const rjMcMC1DModel*>& models, const bool surrogate)
+	{
+		std::vector<std::vector<double>> pred(models.size(), std::vector<double>(ndata));
 
+		const size_t engine = chain_engine();
 		size_t di = 0;
 		for (size_t i = 0; i < nsystems; i++) {
 			cTDEmSystemInfo& S = SV[i];
-			cTDEmSystem& T = S.T;
-			T.setconductivitythickness(c, t);
-			T.setgeometry(G);
-			T.setupcomputations();
-			T.LEM.calculation_type = cLEM::CalculationType::FORWARDMODEL;
-			T.LEM.derivative_layer = INT_MAX;
-			T.setprimaryfields();
-			T.setsecondaryfields();
-			std::vector<double> v = collect(S, T);
-			for (size_t j = 0; j < v.size(); j++) {
-				pred[di] = v[j];
-				di++;
+			cTDEmSystem& T = surrogate ? *SurrogateSystems[engine][i] : (engine == 0 ? S.T : *ChainSystems[engine - 1][i]);
+			size_t nv = 0;
+			for (size_t k = 0; k < models.size(); k++) {
+				const rjMcMC1DModel& m = *models[k];
+				std::vector<double> c = m.getvalues();
+				if (param_value.islog10()) {
+					pow10_apply(c);
+				}
+				const bool newgeometry = (k == 0 || same_nuisances(*models[k - 1], m) == false);
+				T.setconductivitythickness(c, m.getthicknesses());
+				if (newgeometry) T.setgeometry(getgeometry(m));
+				T.setupcomputations();
+				T.LEM.calculation_type = cLEM::CalculationType::FORWARDMODEL;
+				T.LEM.derivative_layer = INT_MAX;
+				if (newgeometry) T.setprimaryfields();
+				T.setsecondaryfields();
+				std::vector<double> v = collect(S, T);
+				for (size_t j = 0; j < v.size(); j++) {
+					pred[k][di + j] = v[j];
+				}
+				nv = v.size();
 			}
-		}		
+			di += nv;
+		}
 		return pred;
 	}
 };
@@ -41,6 +41,7 @@ public:
 
 		std::string stmfile = b.getstringvalue("SystemFile");
 		fixseparator(stmfile);
+		SystemFile = stmfile;
 
 		glog.logmsg(0, "Reading system file %s\n", stmfile.c_str());
 		T.readsystemdescriptorfile(stmfile);
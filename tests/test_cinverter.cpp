@@ -0,0 +1,48 @@
+/*
+This source code file is licensed under the GNU GPL Version 2.0 Licence by the following copyright holder:
+Crown Copyright Commonwealth of Australia (Geoscience Australia) 2015.
+The GNU GPL 2.0 licence is available at: http://www.gnu.org/licenses/gpl-2.0.html. If you require a paper copy of the GNU GPL 2.0 Licence, please write to Free Software Foundation, Inc. 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+
+Author: Ross C. Brodie, Geoscience Australia.
+*/
+
+//tests for cInverter
+#include "../src/cinverter.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cmath>
+
+#include "logger.h"
+
+class cLogger glog;
+
+//a cold start sweeps down from 1e8 in quarter decades
+TEST(cInverterTest, test_cold_start_sweeps_lambda) {
+  std::vector<double> x = cInverter::initial_lambda_trials(0, 1e8, false);
+  ASSERT_GT(x.size(), (size_t)1);
+  EXPECT_DOUBLE_EQ(x.front(), 8.0);
+  for (size_t i = 1; i < x.size(); i++) {
+    EXPECT_DOUBLE_EQ(x[i] - x[i - 1], -0.25);
+  }
+}
+
+//a warm start brackets its start lambda and so needs fewer first iteration trials
+TEST(cInverterTest, test_warm_start_uses_fewer_first_iteration_trials) {
+  const double lambda = 100.0;
+  std::vector<double> cold = cInverter::initial_lambda_trials(0, 1e8, false);
+  std::vector<double> warm = cInverter::initial_lambda_trials(0, lambda, true);
+  EXPECT_LT(warm.size(), cold.size());
+  EXPECT_GT(*std::max_element(warm.begin(), warm.end()), std::log10(lambda));
+  EXPECT_LT(*std::min_element(warm.begin(), warm.end()), std::log10(lambda));
+  EXPECT_NE(std::find(warm.begin(), warm.end(), std::log10(lambda)), warm.end());
+}
+
+//later iterations bracket the current lambda whether or not the inversion was warm started
+TEST(cInverterTest, test_later_iterations_bracket_current_lambda) {
+  const double lambda = 10.0;
+  std::vector<double> a = cInverter::initial_lambda_trials(3, lambda, false);
+  std::vector<double> b = cInverter::initial_lambda_trials(3, lambda, true);
+  EXPECT_EQ(a, b);
+  EXPECT_GT(*std::max_element(a.begin(), a.end()), std::log10(lambda));
+  EXPECT_LT(*std::min_element(a.begin(), a.end()), std::log10(lambda));
+}
@@ -72,6 +72,40 @@ TEST(cProposalTest, test_ar) {
   ASSERT_DOUBLE_EQ(cp.ar(),49.0);
 }
 
+//Philox4x32-10 known answer tests from the Random123 distribution
+TEST(cPhilox4x32Test, test_known_answers) {
+  EXPECT_THAT(cPhilox4x32::generate({0, 0, 0, 0}, {0, 0}),
+              ElementsAre(0x6627e8d5u, 0xe169c58du, 0xbc57ac4cu, 0x9b00dbd8u));
+  EXPECT_THAT(cPhilox4x32::generate({0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff}, {0xffffffff, 0xffffffff}),
+              ElementsAre(0x408f276du, 0x41c83b0eu, 0xa20bc7c6u, 0x6d5451fdu));
+  EXPECT_THAT(cPhilox4x32::generate({0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}, {0xa4093822, 0x299f31d0}),
+              ElementsAre(0xd16cfe09u, 0x94fdccebu, 0x5001e420u, 0x24126ea1u));
+}
+
+//the draws of a sample must not depend on what was drawn before it
+TEST(cCounterRandomStreamTest, test_sample_positioning) {
+  cCounterRandomStream a;
+  cCounterRandomStream b;
+  a.seed(42, 7, 1);
+  b.seed(42, 7, 1);
+  a.set_sample(3);
+  for (size_t i = 0; i < 17; i++) a.nrand();
+  a.set_sample(10);
+  b.set_sample(10);
+  for (size_t i = 0; i < 5; i++) {
+    EXPECT_DOUBLE_EQ(a.urand(), b.urand());
+    EXPECT_DOUBLE_EQ(a.nrand(), b.nrand());
+    EXPECT_EQ(a.irand(2, 9), b.irand(2, 9));
+  }
+
+  //a different chain gives a different stream
+  cCounterRandomStream c;
+  c.seed(42, 7, 2);
+  c.set_sample(10);
+  b.set_sample(10);
+  EXPECT_NE(b.urand(), c.urand());
+}
+
 //testing model
 class rjMcMC1DModelTest : public ::testing::Test {
 protected:
@@ -390,6 +424,43 @@ TEST_F(rjMcMC1DPPDMapTest, test_add_model) {
   EXPECT_TRUE(ppdmap.counts[test_idx4]==1);
 }
 
+TEST_F(rjMcMC1DPPDMapTest, test_add_map) {
+  rjMcMC1DPPDMap other = ppdmap;
+  ppdmap.addmodel(m);
+  other.addmodel(m);
+  other.addmodel(m);
+  ppdmap.addmap(other);
+  EXPECT_TRUE(ppdmap.get_nentries()==3);
+  EXPECT_TRUE(ppdmap.layercounts[2]==3);
+  size_t test_idx1 = ppdmap.index(ppdmap.getpbin(10.0),ppdmap.getvbin(-1.0));
+  EXPECT_TRUE(ppdmap.counts[test_idx1]==3);
+  EXPECT_TRUE(ppdmap.cpcounts[ppdmap.getpbin(20.0)]==3);
+}
+
+//interval updates must bin exactly as which_layer() does, including interfaces on bin centres
+TEST_F(rjMcMC1DPPDMapTest, test_add_model_intervals) {
+  std::vector<rjMcMC1DModel> models(3);
+  models[0].initialise(100.0,-2.0,1.0);
+  models[0].insert_interface(0.0,0.5);
+  models[1].initialise(100.0,-2.0,1.0);
+  models[1].insert_interface(0.0,-1.5);
+  models[1].insert_interface(30.0,0.2);
+  models[1].insert_interface(50.0,-0.9);
+  models[1].insert_interface(55.0,0.9);
+  models[2] = m;
+
+  std::vector<uint32_t> expected(ppdmap.counts.size(), 0);
+  for (const rjMcMC1DModel& mm : models) {
+    ppdmap.addmodel(mm);
+    std::vector<double> mmap = ppdmap.modelmap(mm);
+    for (size_t pi = 0; pi < mmap.size(); pi++) {
+      expected[ppdmap.index(pi, ppdmap.getvbin(mmap[pi]))]++;
+    }
+  }
+  EXPECT_TRUE(ppdmap.counts == expected);
+  EXPECT_EQ(ppdmap.get_nentries(), (size_t)3);
+}
+
 TEST_F(rjMcMC1DPPDMapTest, test_reset) {
   ppdmap.addmodel(m);
   EXPECT_TRUE(ppdmap.get_nentries()==1);
@@ -506,6 +577,86 @@ TEST_F(rjMcMC1DPPDMapTest, test_multi_model_summary) {
 
 }
 
+TEST_F(rjMcMC1DModelTest, test_packed_model) {
+  m.insert_interface(0.0, cond_max - 1.0);
+  m.insert_interface(10.0, cond_min + 1.0);
+  m.insert_interface(37.5, cond_min);
+  m.set_misfit(12.5);
+
+  cPackedModel p;
+  p.pack(m, depth_max, cond_min, cond_max, false);
+  ASSERT_TRUE(p.nlayers() == 3);
+  EXPECT_FLOAT_EQ(p.misfit, 12.5f);
+  EXPECT_TRUE(p.predicted.empty());
+  for (size_t li = 0; li < 3; li++) {
+    EXPECT_NEAR(cPackedModel::dequantise(p.ptop[li], 0.0, depth_max), m.layers[li].ptop, depth_max / 65535.0);
+    EXPECT_NEAR(cPackedModel::dequantise(p.value[li], cond_min, cond_max), m.layers[li].value, (cond_max - cond_min) / 65535.0);
+  }
+}
+
+//two reservoirs merged must hold the smallest keys of everything offered to either
+TEST(cModelReservoirTest, test_merge_keeps_smallest_keys) {
+  cModelReservoir a;
+  cModelReservoir b;
+  a.initialise(5);
+  b.initialise(5);
+  cCounterRandomStream r;
+  r.seed(1, 2, 3);
+  r.set_sample(0);
+  std::vector<double> keys;
+  for (size_t i = 0; i < 200; i++) {
+    const double key = r.urand();
+    keys.push_back(key);
+    cModelReservoir& res = (i % 3 == 0) ? a : b;
+    if (res.offer(key, (double)i)) {
+      cPackedModel p;
+      p.misfit = (float)key;
+      res.keep(key, std::move(p));
+    }
+  }
+  a.merge(b);
+  EXPECT_EQ(a.size(), (size_t)5);
+  EXPECT_EQ(a.noffered(), (size_t)200);
+  EXPECT_DOUBLE_EQ(a.misfit_mean(), 199.0 / 2.0);
+
+  std::sort(keys.begin(), keys.end());
+  std::vector<const cPackedModel*> kept = a.models();
+  for (size_t i = 0; i < kept.size(); i++) {
+    EXPECT_FLOAT_EQ(kept[i]->misfit, (float)keys[i]);
+  }
+}
+
+TEST(cConvergenceDiagnosticsTest, test_rhat_and_ess) {
+  cCounterRandomStream r;
+  r.seed(5, 0, 0);
+  r.set_sample(0);
+  std::vector<float> a(2000), b(2000), c(2000);
+  for (size_t i = 0; i < a.size(); i++) {
+    a[i] = (float)r.nrand();
+    b[i] = (float)r.nrand();
+    c[i] = (float)(r.nrand() + 3.0);
+  }
+  //chains from the same distribution
+  EXPECT_NEAR(cConvergenceDiagnostics::rhat({&a, &b}), 1.0, 0.01);
+  //a chain stuck somewhere else
+  EXPECT_GT(cConvergenceDiagnostics::rhat({&a, &c}), 1.5);
+  //independent draws have an effective sample size close to their number
+  EXPECT_GT(cConvergenceDiagnostics::ess(a), 1500.0);
+
+  //a slowly drifting series has few effective samples
+  std::vector<float> d(2000);
+  for (size_t i = 0; i < d.size(); i++) d[i] = (float)std::sin((double)i / 300.0);
+  EXPECT_LT(cConvergenceDiagnostics::ess(d), 50.0);
+}
+
+TEST(cConvergenceDiagnosticsTest, test_ppd_change) {
+  std::vector<uint32_t> a = {2, 2, 0, 4};
+  std::vector<uint32_t> b = {4, 4, 0, 8};
+  std::vector<uint32_t> c = {0, 4, 4, 0};
+  EXPECT_DOUBLE_EQ(cConvergenceDiagnostics::ppd_change(a, 4, b, 8, 2), 0.0);
+  EXPECT_DOUBLE_EQ(cConvergenceDiagnostics::ppd_change(a, 4, c, 4, 2), 1.0);
+}
+
 //mock sampler so we can catch forward calls and
 //individually control their behaviour.
 class MockSampler : public rjMcMC1DSampler {
@@ -655,3 +806,176 @@ TEST_F(rjMcMC1DSamplerWithNuisanceTest, test_nuisance_move_leaves_mcur_unchanged
   s.propose_nuisancechange(s.chains[0],mpro);
   EXPECT_DOUBLE_EQ(s.chains[0].model.nuisances[0]->value,oldval);
 }
+
+//simple layered-earth response so whole chains can be run without a forward model engine
+class HalfspaceSampler : public rjMcMC1DSampler {
+public:
+  std::vector<double> forwardmodel(const rjMcMC1DModel& m) override {
+    std::vector<double> pred(ndata);
+    for (size_t di = 0; di < ndata; di++) {
+      size_t li = m.which_layer(10.0 * (double)di);
+      pred[di] = std::pow(10.0, m.layers[li].value) + 0.1;
+    }
+    return pred;
+  }
+};
+
+class rjMcMC1DSamplerChainThreadsTest : public ::testing::Test {
+protected:
+  void run(HalfspaceSampler& s, const size_t nthreads) {
+    s.obs = {1.1, 0.6, 0.2, 0.15};
+    s.err = {0.05, 0.03, 0.01, 0.01};
+    s.ndata = s.obs.size();
+    s.nl_min = 1;
+    s.nl_max = 6;
+    s.pmax = 50.0;
+    s.vmin = -3.0;
+    s.vmax = 1.0;
+    s.pmap.initialise(s.nl_min, s.nl_max, s.pmax, 10, s.vmin, s.vmax, 8);
+    s.chains.resize(4);
+    s.nsamples = 2000;
+    s.nburnin = 200;
+    s.thinrate = 10;
+    s.temperature_high = 2.5;
+    s.ChainThreads = nthreads;
+    s.RecordKey = 11;
+    s.reset();
+    s.sample();
+  }
+};
+
+//chains are combined in chain order so the result must not depend on the thread count
+TEST_F(rjMcMC1DSamplerChainThreadsTest, test_threads_reproducible) {
+  HalfspaceSampler a;
+  HalfspaceSampler b;
+  run(a, 1);
+  run(b, 3);
+  EXPECT_EQ(a.pmap.get_nentries(), (size_t)180);
+  EXPECT_EQ(a.pmap.get_nentries(), b.pmap.get_nentries());
+  EXPECT_TRUE(a.pmap.counts == b.pmap.counts);
+  EXPECT_TRUE(a.pmap.cpcounts == b.pmap.cpcounts);
+  EXPECT_EQ(a.ensemble.size(), b.ensemble.size());
+  EXPECT_DOUBLE_EQ(a.HighestLikelihood.logppd(), b.HighestLikelihood.logppd());
+  EXPECT_DOUBLE_EQ(a.LowestMisfit.get_misfit(), b.LowestMisfit.get_misfit());
+}
+
+//counts full forward model runs, the surrogate scales the exact response
+class SurrogateSampler : public HalfspaceSampler {
+public:
+  size_t nfull = 0;
+  double scale = 1.0;
+  std::vector<double> forwardmodel(const rjMcMC1DModel& m) override {
+    nfull++;
+    return HalfspaceSampler::forwardmodel(m);
+  }
+  std::vector<double> forwardmodel_surrogate(const rjMcMC1DModel& m) override {
+    std::vector<double> pred = HalfspaceSampler::forwardmodel(m);
+    for (size_t di = 0; di < pred.size(); di++) pred[di] *= scale;
+    return pred;
+  }
+  size_t accepted() const {
+    size_t n = 0;
+    for (const cChain& c : chains) {
+      n += c.pvaluechange.na + c.pmove.na + c.pbirth.na + c.pdeath.na;
+    }
+    return n;
+  }
+  size_t screened(const bool passed) const {
+    size_t n = 0;
+    for (const cChain& c : chains) n += passed ? c.pscreen.na : c.pscreen.np;
+    return n;
+  }
+};
+
+//the full forward model only runs for proposals passing the surrogate screen
+TEST_F(rjMcMC1DSamplerChainThreadsTest, test_delayed_acceptance) {
+  //an exact surrogate never rejects at the second stage
+  SurrogateSampler a;
+  a.DelayedAcceptance = true;
+  run(a, 1);
+  EXPECT_EQ(a.nfull, a.chains.size() + a.screened(true));
+  EXPECT_EQ(a.accepted(), a.screened(true));
+  EXPECT_LT(a.screened(true), a.screened(false));
+
+  //an approximate surrogate is corrected at the second stage
+  SurrogateSampler b;
+  b.DelayedAcceptance = true;
+  b.scale = 1.2;
+  run(b, 1);
+  EXPECT_EQ(b.nfull, b.chains.size() + b.screened(true));
+  EXPECT_LT(b.accepted(), b.screened(true));
+  EXPECT_LT(b.nfull, b.screened(false));
+
+  //without delayed acceptance every proposal runs the full forward model
+  SurrogateSampler c;
+  run(c, 1);
+  EXPECT_EQ(c.screened(false), (size_t)0);
+  EXPECT_GT(c.nfull, a.nfull);
+  EXPECT_EQ(c.accepted(), a.accepted());
+  EXPECT_TRUE(c.pmap.counts == a.pmap.counts);
+}
+
+//records the size of each batched forward call
+class BatchSampler : public HalfspaceSampler {
+public:
+  std::vector<size_t> batches;
+  std::vector<std::vector<double>> forwardmodel_batch(const std::vector<const rjMcMC1DModel*>& models) override {
+    batches.push_back(models.size());
+    return HalfspaceSampler::forwardmodel_batch(models);
+  }
+};
+
+//value change and move candidates are evaluated together
+TEST_F(rjMcMC1DSamplerChainThreadsTest, test_multiple_try) {
+  BatchSampler a;
+  a.MultipleTryCandidates = 4;
+  run(a, 1);
+  ASSERT_GT(a.batches.size(), (size_t)0);
+  EXPECT_EQ(*std::max_element(a.batches.begin(), a.batches.end()), (size_t)4);
+  size_t na = 0;
+  for (const cChain& c : a.chains) {
+    na += c.pvaluechange.na + c.pmove.na;
+    EXPECT_LE(c.pvaluechange.na, c.pvaluechange.np);
+  }
+  EXPECT_GT(na, (size_t)0);
+
+  //a single candidate is the ordinary Metropolis-Hastings proposal
+  BatchSampler b;
+  run(b, 1);
+  EXPECT_EQ(b.batches.size(), (size_t)0);
+}
+
+//thresholds that always pass stop sampling at the first check after burn-in
+TEST_F(rjMcMC1DSamplerChainThreadsTest, test_stop_when_converged) {
+  HalfspaceSampler a;
+  a.ConvergenceInterval = 100;
+  a.StopWhenConverged = true;
+  a.RhatThreshold = DBL_MAX;
+  a.MinimumESS = 0.0;
+  a.PPDChangeThreshold = 1.0;
+  run(a, 2);
+  ASSERT_EQ(a.convergence.sample.size(), (size_t)1);
+  EXPECT_EQ(a.convergence.sample[0], (uint32_t)300);
+  EXPECT_EQ(a.nsamples_run, (size_t)301);
+  EXPECT_EQ(a.pmap.get_nentries(), (size_t)11);
+
+  //without StopWhenConverged the checks are only recorded
+  HalfspaceSampler b;
+  b.ConvergenceInterval = 100;
+  run(b, 1);
+  EXPECT_EQ(b.nsamples_run, b.nsamples);
+  EXPECT_EQ(b.convergence.sample.size(), (size_t)17);
+}
+
+//the diagnostics follow the temperature 1 slot across swaps, so its trace holds every map sample in order
+TEST_F(rjMcMC1DSamplerChainThreadsTest, test_convergence_trace_follows_temperature) {
+  HalfspaceSampler a;
+  a.ConvergenceInterval = 100;
+  run(a, 2);
+  ASSERT_EQ(a.trace_misfit.size(), a.nchains());
+  EXPECT_EQ(a.trace_misfit[0].size(), a.pmap.get_nentries());
+  EXPECT_EQ(a.trace_nlayers[0].size(), a.pmap.get_nentries());
+  for (size_t k = 1; k < a.nchains(); k++) {
+    EXPECT_TRUE(a.trace_misfit[k].empty());
+  }
+}